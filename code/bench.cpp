@@ -0,0 +1,969 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <tclap/CmdLine.h>
+
+#include "forest.h"
+#include "gif_indexed.h"
+#include "physics.h"
+#include "raw_video.h"
+#include "render.h"
+#include "simulation.h"
+#include "thread_pool.h"
+#include "trajectory.h"
+
+
+using namespace std;
+
+
+const string VERSION = "0.0.0";
+
+
+// Time fn (which does `work` units of work per call) for at least min_time
+// seconds and return the rate in units per second
+double measure(function<void()> fn, double work, double min_time) {
+  using clock = chrono::steady_clock;
+  fn(); // warm up
+  size_t reps = 0;
+  auto start = clock::now();
+  double elapsed;
+  do {
+    fn();
+    ++reps;
+    elapsed = chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < min_time);
+  return work * reps / elapsed;
+}
+
+
+// Keep results alive so the optimizer can't drop the benchmarked work
+volatile double sink;
+
+
+// Every measurement is also kept for the JSON output (--json), to compare
+// runs across versions. Values are in units per second.
+struct Result {
+  string benchmark;
+  string variant;
+  vector< pair<string, double> > parameters;
+  double value;
+  string unit;
+};
+
+vector<Result> results;
+
+double record(const string &benchmark, const string &variant
+              , vector< pair<string, double> > parameters, double value, const string &unit) {
+  results.push_back(Result{benchmark, variant, move(parameters), value, unit});
+  return value;
+}
+
+void write_json(ostream &out, size_t threads) {
+  // names are plain identifiers, nothing needs escaping
+  out << setprecision(9);
+  out << "{\n  \"version\": \"" << VERSION << "\",\n";
+#ifdef PHYSICS_AVX2
+  out << "  \"avx2\": " << (have_avx2() ? "true" : "false") << ",\n";
+#else
+  out << "  \"avx2\": false,\n";
+#endif
+  out << "  \"threads\": " << threads << ",\n";
+  out << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    out << (i > 0 ? "," : "") << "\n    {\"benchmark\": \"" << r.benchmark
+        << "\", \"variant\": \"" << r.variant << "\", \"parameters\": {";
+    for (size_t k = 0; k < r.parameters.size(); ++k)
+      out << (k > 0 ? ", " : "") << '"' << r.parameters[k].first << "\": " << r.parameters[k].second;
+    out << "}, \"value\": " << r.value << ", \"unit\": \"" << r.unit << "\"}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+
+// The force kernel as it was before the switch to structure of arrays, kept
+// for comparison: points carry a refcounted pointer to their cell and the
+// force is computed with pow and two square roots per pair.
+namespace legacy {
+  struct Point {
+    double x;
+    double y;
+    shared_ptr<int> cell = nullptr;
+  };
+
+  Vector lj_force(Point a, Point b) {
+    double r2 = (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);
+    if (r2 <= 0.0)
+      return Vector {0.01, 0.01};
+    double r6 = pow(r2, 3.0);
+    double f =  epsilon4 * 6.0 * sigma6 * (r6 - 2.0 * sigma6) / (r6 * r6 * sqrt(r2));
+    Vector q {b.x - a.x, b.y - a.y};
+    double qmag = sqrt(q.x*q.x + q.y*q.y);
+    q.x /= qmag;
+    q.y /= qmag;
+    q.x *= f;
+    q.y *= f;
+    return q;
+  }
+
+  // Text trajectory output and input before TextTrajectoryWriter/Reader:
+  // operator<< per number and a flush per frame, regexes matched against the
+  // rest of the line after every point
+  void write_frame(ostream &out, double time, const vector<double> &x, const vector<double> &y) {
+    out << time << ' ';
+    for (size_t i = 0; i < x.size(); ++i) {
+      if (i > 0)
+        out << ", ";
+      out << static_cast<char>('A' + i % 2) << '(' << x[i] << ", " << y[i] << ')';
+    }
+    out << endl;
+  }
+
+  size_t parse_input(istream &f) {
+    string s;
+    regex re_time(R"((\d+.?\d*e?-?\d*))");
+    regex re_point(R"(([A-Z])\((-?\d+.?\d*e?-?\d*), (-?\d+.?\d*e?-?\d*)\))");
+    size_t n = 0;
+    while (getline(f, s)) {
+      smatch m;
+      regex_search(s, m, re_time);
+      sink = stod(m[1]);
+      while (regex_search(s, m, re_point)) {
+        sink = stod(m[2]) + stod(m[3]);
+        ++n;
+        s = m.suffix().str();
+      }
+    }
+    return n;
+  }
+}
+
+
+void bench_lj_force(size_t n, double min_time) {
+  // a loosely packed blob, like a growing colony
+  mt19937 rng(1);
+  normal_distribution<double> position(0.0, sigma * sqrt(n) / 2.0);
+  vector<double> x(n);
+  vector<double> y(n);
+  vector<legacy::Point> points(n);
+  auto cell = make_shared<int>(0);
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = position(rng);
+    y[i] = position(rng);
+    points[i] = legacy::Point{x[i], y[i], cell};
+  }
+  double pairs = static_cast<double>(n) * (n - 1);
+  double inf = numeric_limits<double>::infinity();
+
+  double legacy_rate = measure([&]() {
+      double s = 0.0;
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+          if (i == j) continue;
+          s += legacy::lj_force(points[i], points[j]).x;
+        }
+      }
+      sink = s;
+    }, pairs, min_time);
+
+  double scalar_rate = measure([&]() {
+      double s = 0.0;
+      for (size_t i = 0; i < n; ++i)
+        s += lj_accumulate_scalar(x[i], y[i], x.data(), y.data(), n, i, inf).x;
+      sink = s;
+    }, pairs, min_time);
+
+  record("lj_force", "legacy", {{"particles", n}}, legacy_rate, "pairs/s");
+  record("lj_force", "scalar", {{"particles", n}}, scalar_rate, "pairs/s");
+  cout << "lj_force, " << n << " particles, all pairs" << endl;
+  cout << "  legacy AoS kernel  " << legacy_rate / 1e6 << " Mpairs/s" << endl;
+  cout << "  scalar SoA kernel  " << scalar_rate / 1e6 << " Mpairs/s ("
+       << scalar_rate / legacy_rate << "x)" << endl;
+
+#ifdef PHYSICS_AVX2
+  if (!have_avx2()) {
+    cout << "  AVX2 SoA kernel    not supported by this CPU" << endl;
+    return;
+  }
+  double avx2_rate = measure([&]() {
+      double s = 0.0;
+      for (size_t i = 0; i < n; ++i)
+        s += lj_accumulate_avx2(x[i], y[i], x.data(), y.data(), n, i, inf).x;
+      sink = s;
+    }, pairs, min_time);
+  record("lj_force", "avx2", {{"particles", n}}, avx2_rate, "pairs/s");
+  cout << "  AVX2 SoA kernel    " << avx2_rate / 1e6 << " Mpairs/s ("
+       << avx2_rate / legacy_rate << "x)" << endl;
+
+  vector<float> xf(x.begin(), x.end());
+  vector<float> yf(y.begin(), y.end());
+  double avx2_float_rate = measure([&]() {
+      double s = 0.0;
+      for (size_t i = 0; i < n; ++i)
+        s += lj_accumulate_avx2(xf[i], yf[i], xf.data(), yf.data(), n, i, inf).x;
+      sink = s;
+    }, pairs, min_time);
+  record("lj_force", "avx2_float", {{"particles", n}}, avx2_float_rate, "pairs/s");
+  cout << "  AVX2 SoA, float    " << avx2_float_rate / 1e6 << " Mpairs/s ("
+       << avx2_float_rate / legacy_rate << "x)" << endl;
+#else
+  cout << "  AVX2 SoA kernel    not compiled in (x86 with GCC or clang only)" << endl;
+#endif
+}
+
+
+// Synthetic forests of n_trees complete binary trees with the given depth
+// (2^(depth + 1) - 1 cells each), with random lifetimes
+string balanced_forest(size_t n_trees, int depth, mt19937 &rng) {
+  uniform_real_distribution<double> lifetime(0.01, 1.0);
+  uniform_int_distribution<int> type(0, 1);
+  string s;
+  function<void(int)> node = [&](int d) {
+    if (d > 0) {
+      s += '(';
+      node(d - 1);
+      s += ',';
+      node(d - 1);
+      s += ')';
+    }
+    s += static_cast<char>('A' + type(rng));
+    s += ':';
+    s += to_string(lifetime(rng));
+  };
+  for (size_t i = 0; i < n_trees; ++i) {
+    node(depth);
+    s += ';';
+  }
+  return s;
+}
+
+// A single maximally deep tree with n_divisions inner nodes, where one of the
+// daughters of every division divides again
+string caterpillar_forest(size_t n_divisions, mt19937 &rng) {
+  uniform_real_distribution<double> lifetime(0.01, 1.0);
+  string s(n_divisions, '(');
+  s += "A:" + to_string(lifetime(rng));
+  for (size_t i = 0; i < n_divisions; ++i)
+    s += ",B:" + to_string(lifetime(rng)) + ")A:" + to_string(lifetime(rng));
+  s += ';';
+  return s;
+}
+
+
+void bench_parse_forest(int depth, size_t n_trees, double min_time) {
+  const int small_depth = 8;
+  mt19937 rng(1);
+  struct Input {
+    string variant;
+    string description;
+    int depth;
+    size_t trees;
+    string s;
+  };
+  vector<Input> inputs {
+    {"balanced", "balanced, depth " + to_string(depth), depth, 1, balanced_forest(1, depth, rng)},
+    {"caterpillar", "caterpillar, depth " + to_string((1 << depth) - 1), (1 << depth) - 1, 1
+     , caterpillar_forest((1 << depth) - 1, rng)},
+    {"many_trees", to_string(n_trees) + " balanced trees, depth " + to_string(small_depth), small_depth, n_trees
+     , balanced_forest(n_trees, small_depth, rng)},
+  };
+  for (auto &input: inputs) {
+    const string &s = input.s;
+    double nodes = count(s.begin(), s.end(), ':');
+    vector< pair<string, double> > parameters {{"depth", input.depth}, {"trees", input.trees}, {"nodes", nodes}};
+    double rate = measure([&]() {
+        auto forest = parse_forest(s);
+        sink = forest.nodes[forest.roots[0]].birthtime;
+      }, nodes, min_time);
+    record("parse_forest", input.variant, parameters, rate, "nodes/s");
+    record("parse_forest", input.variant, parameters, rate * s.size() / nodes, "bytes/s");
+    cout << "parse_forest, " << input.description << ", " << static_cast<size_t>(nodes) << " nodes" << endl;
+    cout << "  " << rate / 1e6 << " Mnodes/s, "
+         << rate * s.size() / nodes / 1e6 << " MB/s" << endl;
+  }
+
+  // one tree at a time into the same arena, as when trees are added one by one
+  const Input &single = inputs[0];
+  double nodes = count(single.s.begin(), single.s.end(), ':');
+  Forest forest;
+  double rate = measure([&]() {
+      forest.nodes.clear();
+      forest.roots.clear();
+      sink = forest.nodes[parse_tree(forest, single.s, 0.0)].birthtime;
+    }, nodes, min_time);
+  record("parse_tree", single.variant, {{"depth", single.depth}, {"nodes", nodes}}, rate, "nodes/s");
+  cout << "parse_tree, " << single.description << ", into a reused arena" << endl;
+  cout << "  " << rate / 1e6 << " Mnodes/s" << endl;
+}
+
+
+// A synthetic trajectory: a loosely packed blob of n_points cells of two
+// types, where every cell takes a small random step from one frame to the next
+struct SyntheticTrajectory {
+  vector< vector<double> > x;
+  vector< vector<double> > y;
+  vector<unsigned> type;
+
+  size_t frames() const { return x.size(); }
+  size_t points() const { return type.size(); }
+
+  vector<Point> frame(size_t f) const {
+    vector<Point> p(points());
+    for (size_t i = 0; i < points(); ++i)
+      p[i] = Point{x[f][i], y[f][i], type[i]};
+    return p;
+  }
+
+  TrajectoryBounds bounds() const {
+    TrajectoryBounds b;
+    for (size_t f = 0; f < frames(); ++f) {
+      for (size_t i = 0; i < points(); ++i)
+        b.add(x[f][i], y[f][i], type[i]);
+    }
+    return b;
+  }
+};
+
+SyntheticTrajectory synthetic_trajectory(size_t n_frames, size_t n_points, mt19937 &rng) {
+  normal_distribution<double> position(0.0, sigma * sqrt(n_points) / 2.0);
+  normal_distribution<double> step(0.0, sigma / 10.0);
+  SyntheticTrajectory t;
+  t.x.assign(n_frames, vector<double>(n_points));
+  t.y.assign(n_frames, vector<double>(n_points));
+  for (size_t i = 0; i < n_points; ++i) {
+    t.type.push_back(i % 2);
+    double x = position(rng);
+    double y = position(rng);
+    for (size_t f = 0; f < n_frames; ++f) {
+      t.x[f][i] = x;
+      t.y[f][i] = y;
+      x += step(rng);
+      y += step(rng);
+    }
+  }
+  return t;
+}
+
+
+void bench_text_trajectory(const SyntheticTrajectory &t, double min_time) {
+  const size_t n_frames = t.frames();
+  const size_t n = t.points();
+  const auto &x = t.x;
+  const auto &y = t.y;
+  ostringstream text;
+  {
+    TextTrajectoryWriter out(text);
+    for (size_t f = 0; f < n_frames; ++f) {
+      out.begin_frame(f * 0.5);
+      for (size_t i = 0; i < n; ++i)
+        out.point(x[f][i], y[f][i], t.type[i]);
+    }
+    out.finish();
+  }
+  const string s = text.str();
+  double mb = s.size() / 1e6;
+
+  double legacy_write = measure([&]() {
+      ostringstream out;
+      for (size_t f = 0; f < n_frames; ++f)
+        legacy::write_frame(out, f * 0.5, x[f], y[f]);
+      sink = out.str().size();
+    }, mb, min_time);
+  double write = measure([&]() {
+      ostringstream out;
+      TextTrajectoryWriter writer(out);
+      for (size_t f = 0; f < n_frames; ++f) {
+        writer.begin_frame(f * 0.5);
+        for (size_t i = 0; i < n; ++i)
+          writer.point(x[f][i], y[f][i], t.type[i]);
+      }
+      writer.finish();
+      sink = out.str().size();
+    }, mb, min_time);
+  double legacy_read = measure([&]() {
+      istringstream in(s);
+      sink = legacy::parse_input(in);
+    }, mb, min_time);
+  double read = measure([&]() {
+      istringstream in(s);
+      TextTrajectoryReader reader(in);
+      double time;
+      double sum = 0.0;
+      while (reader.next(time, [&](double px, double py, unsigned) { sum += px + py; }))
+        ;
+      sink = sum;
+    }, mb, min_time);
+
+  vector< pair<string, double> > parameters {{"frames", n_frames}, {"points", n}, {"bytes", s.size()}};
+  record("text_trajectory_write", "ostream", parameters, legacy_write * 1e6, "bytes/s");
+  record("text_trajectory_write", "to_chars", parameters, write * 1e6, "bytes/s");
+  record("parse_input", "regex", parameters, legacy_read * 1e6, "bytes/s");
+  record("parse_input", "from_chars", parameters, read * 1e6, "bytes/s");
+  cout << "text trajectory, " << n_frames << " frames of " << n << " points, "
+       << mb << " MB" << endl;
+  cout << "  write, ostream       " << legacy_write << " MB/s" << endl;
+  cout << "  write, to_chars      " << write << " MB/s (" << write / legacy_write << "x)" << endl;
+  cout << "  read, regex          " << legacy_read << " MB/s" << endl;
+  cout << "  read, from_chars     " << read << " MB/s (" << read / legacy_read << "x)" << endl;
+}
+
+
+// The defaults of particles
+const double timestep = 0.005;
+const double friction = 0.8;
+const double max_velocity = 6.0;
+const double max_acceleration = 3.5;
+
+// Particles as particles steps them, with positions of type T
+template <typename T>
+struct System {
+  vector<T> x;
+  vector<T> y;
+  vector<T> vx;
+  vector<T> vy;
+  vector<double> ax;
+  vector<double> ay;
+  CellGrid<T> grid;
+  NeighbourLists<T> lists;
+
+  template <typename U>
+  System(const vector<U> &x0, const vector<U> &y0)
+    : x(x0.begin(), x0.end())
+    , y(y0.begin(), y0.end())
+    , vx(x0.size(), 0)
+    , vy(x0.size(), 0)
+    , ax(x0.size())
+    , ay(x0.size()) { }
+
+  size_t size() const { return x.size(); }
+
+  // one step, with pairs from the grid or the lists
+  void step(double cutoff, bool use_lists, double skin, ThreadPool &pool) {
+    size_t m = size();
+    if (use_lists) {
+      if (lists.stale(x.data(), y.data(), m))
+        lists.build(x.data(), y.data(), m, cutoff, skin, grid, pool);
+    } else {
+      grid.build(x.data(), y.data(), m, cutoff);
+    }
+    pool.parallel_for(m, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        Vector f = use_lists ? lists.force(i, x.data(), y.data(), cutoff*cutoff) : grid.force(i, cutoff*cutoff);
+        ax[i] = f.x;
+        ay[i] = f.y;
+      }
+    });
+    pool.parallel_for(m, [&](size_t begin, size_t end) {
+      advance(x.data(), y.data(), vx.data(), vy.data(), ax.data(), ay.data()
+              , begin, end, timestep, friction, max_acceleration, max_velocity);
+    });
+  }
+};
+
+
+template <typename T>
+void bench_step_precision(const string &precision, size_t n, size_t threads, double min_time) {
+  const double cutoff = 3.0 * sigma;
+  const double skin = 0.5 * sigma;
+  const double inf = numeric_limits<double>::infinity();
+  ThreadPool pool(threads);
+
+  cout << "physics step, " << precision << ", " << threads << " threads" << endl;
+  // the variants are named as before there was a choice of precision
+  string suffix = precision == "double" ? "" : "_" + precision;
+  for (size_t m: {n / 4, n, 4 * n}) {
+    mt19937 rng(1);
+    normal_distribution<double> position(0.0, sigma * sqrt(m) / 2.0);
+    vector<double> x(m);
+    vector<double> y(m);
+    for (size_t i = 0; i < m; ++i) {
+      x[i] = position(rng);
+      y[i] = position(rng);
+    }
+    System<T> system(x, y);
+
+    double all_pairs = measure([&]() { system.step(inf, false, skin, pool); }, 1.0, min_time);
+    double grid_rate = measure([&]() { system.step(cutoff, false, skin, pool); }, 1.0, min_time);
+    double lists_rate = measure([&]() { system.step(cutoff, true, skin, pool); }, 1.0, min_time);
+    vector< pair<string, double> > parameters {{"particles", m}, {"threads", threads}};
+    record("step", "all_pairs" + suffix, parameters, all_pairs, "steps/s");
+    parameters.push_back({"cutoff", cutoff});
+    record("step", "cell_grid" + suffix, parameters, grid_rate, "steps/s");
+    parameters.push_back({"skin", skin});
+    record("step", "neighbour_lists" + suffix, parameters, lists_rate, "steps/s");
+    cout << "  " << m << " particles" << endl;
+    cout << "    all pairs              " << all_pairs << " steps/s" << endl;
+    cout << "    cutoff 3 sigma, grid   " << grid_rate << " steps/s" << endl;
+    cout << "    cutoff, Verlet lists   " << lists_rate << " steps/s" << endl;
+  }
+}
+
+void bench_step(size_t n, size_t threads, double min_time) {
+  bench_step_precision<double>("double", n, threads, min_time);
+  bench_step_precision<float>("float", n, threads, min_time);
+}
+
+
+// How far a float run of particles drifts from the same run in double:
+// simulate<float> and simulate<double>, as particles runs them, on n_trees
+// balanced trees of the given depth for `steps` timesteps, long enough for
+// cells to divide and die. Divisions and deaths happen at the same steps in
+// both, so the particles of every frame match up. The positions start off by
+// their rounding to float, which the chaotic dynamics amplify after the
+// first division, whose daughters start a few float spacings apart. So the
+// particles are compared one by one only up to the first division or death,
+// each within max_drift sigma, and after that it is the cloud that must
+// match: the radius of the float run (the rms distance from the centroid),
+// relative to that of the double run, off by at most max_radius_drift on
+// average over all frames. Returns false if either is exceeded.
+bool check_drift(size_t n_trees, int depth, size_t steps, double max_drift, double max_radius_drift) {
+  mt19937 rng(1);
+  Arguments a;
+  a.forest = balanced_forest(n_trees, depth, rng);
+  a.timestep = 0.005;
+  a.end_time = steps * a.timestep;
+  a.friction = 0.8;
+  a.max_velocity = 6.0;
+  a.max_acceleration = 3.5;
+  a.cutoff = numeric_limits<double>::infinity();
+  a.skin = 0.0;
+  a.adaptive = false;
+  a.max_timestep = a.timestep;
+  a.tolerance = 0.05 * sigma;
+  a.threads = 1;
+  a.seed = 1;
+  a.format = "binary";
+  a.output_every = 1;
+  a.output_interval = 0.0;
+  a.checkpoint_interval = 0.0;
+  a.resume = false;
+  a.stats = false;
+
+  string directory = filesystem::temp_directory_path().string();
+  Arguments single = a;
+  single.precision = "float";
+  single.outfile = directory + "/bench_drift_float.vspt";
+  Arguments reference = a;
+  reference.precision = "double";
+  reference.outfile = directory + "/bench_drift_double.vspt";
+  ifstream no_checkpoint;
+  if (simulate<float>(single, no_checkpoint) != 0 || simulate<double>(reference, no_checkpoint) != 0)
+    return false;
+
+  // rms distance of the points of frame f from their centroid
+  auto radius = [](const MappedTrajectory &t, size_t f) {
+    size_t n = t.count(f);
+    const TrajectoryPoint *p = t.points(f);
+    double cx = 0.0;
+    double cy = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      cx += p[i].x;
+      cy += p[i].y;
+    }
+    cx /= n;
+    cy /= n;
+    double sum_r2 = 0.0;
+    for (size_t i = 0; i < n; ++i)
+      sum_r2 += (p[i].x - cx) * (p[i].x - cx) + (p[i].y - cy) * (p[i].y - cy);
+    return sqrt(sum_r2 / n);
+  };
+
+  double max_error = 0.0;  // of single particles, before the first event
+  size_t window = 0;       // frames before the first event
+  double sum_radius_error = 0.0;
+  size_t n_clouds = 0;     // frames of at least two particles
+  size_t most_particles = 0;
+  size_t n_frames = 0;
+  {
+    MappedTrajectory s(single.outfile);
+    MappedTrajectory r(reference.outfile);
+    if (s.size() != r.size()) {
+      cout << "  float and double runs have different numbers of frames" << endl;
+      return false;
+    }
+    n_frames = r.size();
+    for (size_t f = 0; f < n_frames; ++f) {
+      size_t n = r.count(f);
+      if (s.count(f) != n) {
+        cout << "  float and double runs have different particles at frame " << f << endl;
+        return false;
+      }
+      most_particles = max(most_particles, n);
+      if (window == f && n == r.count(0)) {
+        const TrajectoryPoint *ps = s.points(f);
+        const TrajectoryPoint *pr = r.points(f);
+        for (size_t i = 0; i < n; ++i) {
+          double dx = static_cast<double>(ps[i].x) - pr[i].x;
+          double dy = static_cast<double>(ps[i].y) - pr[i].y;
+          max_error = max(max_error, sqrt(dx*dx + dy*dy));
+        }
+        window = f + 1;
+      }
+      if (n >= 2) {
+        double r_radius = radius(r, f);
+        sum_radius_error += (radius(s, f) - r_radius) / r_radius;
+        ++n_clouds;
+      }
+    }
+  }
+  filesystem::remove(single.outfile);
+  filesystem::remove(reference.outfile);
+
+  double radius_error = n_clouds > 0 ? sum_radius_error / n_clouds : 0.0;
+  vector< pair<string, double> > parameters {{"trees", n_trees}, {"depth", depth}, {"steps", steps}};
+  record("drift", "max before events", parameters, max_error / sigma, "sigma");
+  record("drift", "radius", parameters, radius_error, "fraction");
+  cout << "drift of float from double, " << n_trees << " trees of depth " << depth << ", "
+       << steps << " steps (" << n_frames << " frames, up to " << most_particles << " particles)" << endl;
+  cout << "  largest " << max_error / sigma << " sigma in the " << window
+       << " frames before the first division or death" << endl;
+  cout << "  radius of the cloud off by " << radius_error << " of it on average" << endl;
+  bool ok = true;
+  if (window < 2) {
+    cout << "  no steps before the first division or death" << endl;
+    ok = false;
+  }
+  if (max_error > max_drift * sigma) {
+    cout << "  more than the allowed " << max_drift << " sigma" << endl;
+    ok = false;
+  }
+  if (abs(radius_error) > max_radius_drift) {
+    cout << "  more than the allowed " << max_radius_drift << " of the radius" << endl;
+    ok = false;
+  }
+  return ok;
+}
+
+
+void bench_render(const SyntheticTrajectory &t, int width, int height, double min_time) {
+  // the bounds of all frames with a margin, as metaballs uses
+  TrajectoryBounds b = t.bounds();
+  double wx = (b.max_x - b.min_x) / 20.0;
+  double wy = (b.max_y - b.min_y) / 20.0;
+  View view{b.min_x - wx, b.max_x + wx, b.min_y - wy, b.max_y + wy, b.max_type, width, height};
+  vector< vector<Point> > frames;
+  for (size_t f = 0; f < t.frames(); ++f)
+    frames.push_back(t.frame(f));
+  size_t n_pixels = static_cast<size_t>(width) * height;
+  vector< vector<uint8_t> > pictures(frames.size(), vector<uint8_t>(n_pixels));
+
+  double full = measure([&]() {
+      for (size_t f = 0; f < frames.size(); ++f) {
+        TileCache cache;
+        render_frame(frames[f].data(), frames[f].size(), pictures[f], cache, view);
+      }
+    }, frames.size(), min_time);
+  TileCache cache;
+  double cached = measure([&]() {
+      for (size_t f = 0; f < frames.size(); ++f)
+        render_frame(frames[f].data(), frames[f].size(), pictures[f], cache, view);
+    }, frames.size(), min_time);
+
+  double gif = measure([&]() {
+      IndexedGifWriter writer("/dev/null", width, height, palette(view.max_type), 17);
+      for (auto &p: pictures)
+        writer.write_frame(p.data());
+      writer.finish();
+    }, frames.size(), min_time);
+  double y4m = measure([&]() {
+      RawVideoWriter writer("/dev/null", width, height, palette(view.max_type), RawVideoWriter::y4m, 100, 17);
+      for (auto &p: pictures)
+        writer.write_frame(p.data());
+      writer.finish();
+    }, frames.size(), min_time);
+
+  vector< pair<string, double> > parameters {{"width", width}, {"height", height}, {"points", t.points()}};
+  record("render_frame", "full", parameters, full, "frames/s");
+  record("render_frame", "tile_cache", parameters, cached, "frames/s");
+  record("gif_write_frame", "indexed", parameters, gif, "frames/s");
+  record("video_write_frame", "y4m", parameters, y4m, "frames/s");
+  cout << "metaballs, " << frames.size() << " frames of " << t.points() << " points at "
+       << width << "x" << height << endl;
+  cout << "  render, every tile       " << full << " frames/s" << endl;
+  cout << "  render, reusing tiles    " << cached << " frames/s" << endl;
+  cout << "  gif write_frame          " << gif << " frames/s, "
+       << gif * n_pixels / 1e6 << " Mpixels/s" << endl;
+  cout << "  y4m write_frame          " << y4m << " frames/s" << endl;
+}
+
+
+// Frames of a GIF as IndexedGifWriter writes it, each as the palette
+// indices shown after drawing its image over the previous frame, leaving out
+// the transparent pixels. Throws runtime_error on anything else (local
+// colour tables, interlacing, other disposal methods).
+vector< vector<uint8_t> > decode_gif(const string &filename) {
+  ifstream f(filename, ios::binary);
+  vector<uint8_t> d((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+  size_t p = 0;
+  auto byte = [&]() -> uint32_t {
+    if (p >= d.size())
+      throw runtime_error(filename + " is truncated");
+    return d[p++];
+  };
+  auto get16 = [&]() { uint32_t lo = byte(); return lo | byte() << 8; };
+  auto sub_blocks = [&]() {
+    vector<uint8_t> data;
+    for (uint32_t n = byte(); n > 0; n = byte()) {
+      for (uint32_t i = 0; i < n; ++i)
+        data.push_back(byte());
+    }
+    return data;
+  };
+
+  for (char c: string("GIF89a")) {
+    if (byte() != static_cast<uint8_t>(c))
+      throw runtime_error(filename + " is not a gif");
+  }
+  size_t width = get16();
+  size_t height = get16();
+  uint32_t flags = byte();
+  p += 2; // background colour, aspect ratio
+  if (flags & 0x80)
+    p += 3 * (2u << (flags & 7));
+
+  vector< vector<uint8_t> > frames;
+  vector<uint8_t> canvas(width * height, 0);
+  int transparent = -1;
+  for (uint32_t block = byte(); block != 0x3b; block = byte()) {
+    if (block == 0x21) {
+      uint32_t label = byte();
+      vector<uint8_t> data = sub_blocks();
+      if (label == 0xf9) {
+        if (data.size() != 4 || ((data[0] >> 2) & 7) > 1)
+          throw runtime_error(filename + " has an unsupported graphic control extension");
+        transparent = data[0] & 1 ? data[3] : -1;
+      }
+      continue;
+    }
+    if (block != 0x2c)
+      throw runtime_error(filename + " has an unknown block");
+    size_t x0 = get16();
+    size_t y0 = get16();
+    size_t w = get16();
+    size_t h = get16();
+    if (byte() != 0 || x0 + w > width || y0 + h > height)
+      throw runtime_error(filename + " has an unsupported image");
+    int min_code_size = byte();
+    vector<uint8_t> data = sub_blocks();
+
+    // LZW, with codes packed from the least significant bit
+    const uint32_t clear_code = 1u << min_code_size;
+    const uint32_t end_code = clear_code + 1;
+    vector< vector<uint8_t> > table;
+    int code_size = 0;
+    int previous = -1;
+    auto reset = [&]() {
+      table.assign(end_code + 1, vector<uint8_t>());
+      for (uint32_t i = 0; i < clear_code; ++i)
+        table[i].push_back(i);
+      code_size = min_code_size + 1;
+      previous = -1;
+    };
+    reset();
+    vector<uint8_t> pixels;
+    size_t bit = 0;
+    while (true) {
+      if (bit + code_size > 8 * data.size())
+        throw runtime_error(filename + " has an image without an end code");
+      uint32_t code = 0;
+      for (int b = 0; b < code_size; ++b, ++bit)
+        code |= ((data[bit / 8] >> (bit % 8)) & 1u) << b;
+      if (code == clear_code) {
+        reset();
+        continue;
+      }
+      if (code == end_code)
+        break;
+      vector<uint8_t> entry;
+      if (code < table.size() && !table[code].empty()) {
+        entry = table[code];
+      } else if (code == table.size() && previous >= 0) {
+        entry = table[previous];
+        entry.push_back(entry[0]);
+      } else {
+        throw runtime_error(filename + " has an invalid code");
+      }
+      pixels.insert(pixels.end(), entry.begin(), entry.end());
+      if (previous >= 0 && table.size() < 4096) {
+        table.push_back(table[previous]);
+        table.back().push_back(entry[0]);
+      }
+      if (table.size() == (1u << code_size) && code_size < 12)
+        ++code_size;
+      previous = code;
+    }
+    if (pixels.size() != w * h)
+      throw runtime_error(filename + " has an image of the wrong size");
+
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        uint8_t c = pixels[y*w + x];
+        if (c != transparent)
+          canvas[(y0 + y) * width + x0 + x] = c;
+      }
+    }
+    frames.push_back(canvas);
+    transparent = -1;
+  }
+  return frames;
+}
+
+
+// Write the frames of t rendered at width x height as a gif with only the
+// changed rectangles (and transparency) and as one with whole frames,
+// followed by a repeat of the last frame and by one in which every pixel
+// changes. Returns false unless both decode to exactly the rendered frames.
+bool check_gif_deltas(const SyntheticTrajectory &t, int width, int height) {
+  TrajectoryBounds b = t.bounds();
+  View view{b.min_x, b.max_x, b.min_y, b.max_y, b.max_type, width, height};
+  vector<IndexedGifWriter::Colour> colours = palette(view.max_type);
+  size_t n_pixels = static_cast<size_t>(width) * height;
+  vector< vector<uint8_t> > pictures;
+  TileCache cache;
+  for (size_t f = 0; f < t.frames(); ++f) {
+    vector<Point> points = t.frame(f);
+    pictures.emplace_back(n_pixels);
+    render_frame(points.data(), points.size(), pictures.back(), cache, view);
+  }
+  pictures.push_back(pictures.back());
+  pictures.push_back(pictures.back());
+  for (auto &c: pictures.back())
+    c = (c + 1) % colours.size();
+
+  cout << "gif round trip, " << pictures.size() << " frames at " << width << "x" << height << endl;
+  bool ok = true;
+  for (bool deltas: {true, false}) {
+    string filename = (filesystem::temp_directory_path() / "bench_deltas.gif").string();
+    uint64_t bytes;
+    vector< vector<uint8_t> > decoded;
+    try {
+      IndexedGifWriter writer(filename, width, height, colours, 17, deltas);
+      for (auto &p: pictures)
+        writer.write_frame(p.data());
+      writer.finish();
+      bytes = writer.bytes();
+      decoded = decode_gif(filename);
+    } catch (runtime_error &e) {
+      cout << "  " << e.what() << endl;
+      return false;
+    }
+    filesystem::remove(filename);
+    size_t wrong = 0;
+    for (size_t f = 0; f < pictures.size(); ++f) {
+      if (f >= decoded.size() || decoded[f] != pictures[f])
+        ++wrong;
+    }
+    cout << "  " << (deltas ? "changed rectangles " : "whole frames       ") << bytes << " bytes, ";
+    if (wrong == 0 && decoded.size() == pictures.size()) {
+      cout << "every frame identical" << endl;
+    } else {
+      cout << wrong << " frames differ (" << decoded.size() << " decoded)" << endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+
+int main(int argc, char **argv) {
+  size_t particles;
+  int depth;
+  size_t trees;
+  size_t frames;
+  int width;
+  int height;
+  size_t threads;
+  double min_time;
+  size_t drift_steps;
+  double max_drift;
+  double max_radius_drift;
+  string run;
+  string json;
+  try {
+    TCLAP::CmdLine cmd("Benchmarks for the particle and rendering kernels", ' ', VERSION);
+
+    TCLAP::ValueArg<size_t> a_particles("n", "particles", "Number of particles (the physics step also runs a quarter and four times as many)", false, 2000, "integer", cmd);
+    TCLAP::ValueArg<int> a_depth("D", "depth", "Depth of synthetic trees", false, 20, "integer", cmd);
+    TCLAP::ValueArg<size_t> a_trees("N", "trees", "Number of trees in the synthetic forest of small trees", false, 1000, "integer", cmd);
+    TCLAP::ValueArg<size_t> a_frames("F", "frames", "Frames of the synthetic trajectory", false, 20, "integer", cmd);
+    TCLAP::ValueArg<int> a_width("x", "width", "Width of rendered frames in pixels", false, 640, "integer", cmd);
+    TCLAP::ValueArg<int> a_height("y", "height", "Height of rendered frames in pixels", false, 480, "integer", cmd);
+    TCLAP::ValueArg<size_t> a_threads("j", "threads", "Number of threads for the physics step", false, 1, "integer", cmd);
+    TCLAP::ValueArg<double> a_min_time("s", "seconds", "Minimum time to run each benchmark", false, 1.0, "double", cmd);
+    TCLAP::ValueArg<size_t> a_drift_steps("", "drift-steps", "Steps of the particles run comparing float with double precision", false, 600, "integer", cmd);
+    TCLAP::ValueArg<double> a_max_drift("", "max-drift", "Largest drift of a float position from double allowed in that run before the first division or death, in units of sigma (exit status 1 if exceeded)", false, 0.001, "double", cmd);
+    TCLAP::ValueArg<double> a_max_radius_drift("", "max-radius-drift", "Largest average difference of the radius of the cloud of float particles from double in that run, as a fraction of the radius (exit status 1 if exceeded)", false, 0.025, "double", cmd);
+    TCLAP::ValueArg<string> a_run("r", "run", "Comma separated benchmarks to run (all if not given)", false, "", "lj_force,parse_forest,text_trajectory,step,drift,render,gif", cmd);
+    TCLAP::ValueArg<string> a_json("J", "json", "Also write the results to this file as JSON", false, "", "filename", cmd);
+
+    cmd.parse(argc, argv);
+
+    particles = a_particles.getValue();
+    depth = a_depth.getValue();
+    trees = a_trees.getValue();
+    frames = a_frames.getValue();
+    width = a_width.getValue();
+    height = a_height.getValue();
+    threads = a_threads.getValue();
+    min_time = a_min_time.getValue();
+    drift_steps = a_drift_steps.getValue();
+    max_drift = a_max_drift.getValue();
+    max_radius_drift = a_max_radius_drift.getValue();
+    run = a_run.getValue();
+    json = a_json.getValue();
+
+    if (particles < 4 || depth < 1 || depth > 24 || trees < 1 || frames < 1 || width < 1 || height < 1 || threads < 1) {
+      cerr << "sizes must be positive, with at least 4 particles and a depth of at most 24" << endl;
+      return 1;
+    }
+
+  } catch (TCLAP::ArgException &e) {
+    cerr << "TCLAP Error: " << e.error() << endl << "\targ: " << e.argId() << endl;
+    return 1;
+  }
+
+  auto selected = [&](const string &name) {
+    return run.empty() || ("," + run + ",").find("," + name + ",") != string::npos;
+  };
+
+  mt19937 rng(1);
+  SyntheticTrajectory trajectory = synthetic_trajectory(frames, particles, rng);
+  if (selected("lj_force"))
+    bench_lj_force(particles, min_time);
+  if (selected("parse_forest"))
+    bench_parse_forest(depth, trees, min_time);
+  if (selected("text_trajectory"))
+    bench_text_trajectory(trajectory, min_time);
+  if (selected("step"))
+    bench_step(particles, threads, min_time);
+  bool drift_ok = true;
+  if (selected("drift"))
+    drift_ok = check_drift(4, 5, drift_steps, max_drift, max_radius_drift);
+  if (selected("render"))
+    bench_render(trajectory, width, height, min_time);
+  bool gif_ok = true;
+  if (selected("gif"))
+    gif_ok = check_gif_deltas(trajectory, width, height);
+
+  if (!json.empty()) {
+    ofstream out(json);
+    write_json(out, threads);
+    if (!out) {
+      cerr << "cannot write " << json << endl;
+      return 1;
+    }
+  }
+  return drift_ok && gif_ok ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Check that two builds of particles write byte-identical trajectories, for
+# changes that aren't meant to change the simulation.
+#
+#   compare_particles.sh OLD_PARTICLES NEW_PARTICLES FORESTFILE [SEED]
+#
+# Runs both with all pairs, a cutoff, a cutoff with neighbour lists, adaptive
+# steps and several threads. Exit status 1 if any pair of outputs differ.
+
+if [ $# -lt 3 ]; then
+  echo "usage: $0 OLD_PARTICLES NEW_PARTICLES FORESTFILE [SEED]" >&2
+  exit 2
+fi
+old=$1
+new=$2
+forest=$3
+seed=${4:-5}
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+
+status=0
+while read -r options; do
+  "$old" -i "$forest" -S "$seed" $options > "$dir/old" 2> /dev/null
+  "$new" -i "$forest" -S "$seed" $options > "$dir/new" 2> /dev/null
+  if cmp -s "$dir/old" "$dir/new"; then
+    echo "same:      $options"
+  else
+    echo "different: $options"
+    status=1
+  fi
+done <<EOF
+-t 10
+-t 10 -c 0.1
+-t 10 -c 0.1 -k 0.02
+-t 10 -A -s 0.1
+-t 10 -j 3
+EOF
+exit $status
@@ -0,0 +1,252 @@
+#ifndef FOREST_H
+#define FOREST_H
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+
+// A cell in the lineage. birthtime is the (absolute) time at which the cell
+// divides into left and right, or dies if it has no children (left and right
+// are no_node). Daughters are indices into the same Forest.
+struct Node {
+  double birthtime;
+  uint32_t left;
+  uint32_t right;
+  uint32_t type;
+
+  bool leaf() const { return left == no_node; }
+};
+
+// All cells of all trees, allocated from one flat array. Every tree is a
+// contiguous range of nodes with its root last, and daughters always come
+// before their mother.
+struct Forest {
+  std::vector<Node> nodes;
+  std::vector<uint32_t> roots;
+
+  const Node &operator[](uint32_t i) const { return nodes[i]; }
+};
+
+
+// Parser for forests of trees like "((A:1,B:2)A:0.5,A:3)A:1;A:4;" where every
+// node is a cell type letter and its lifetime, and inner nodes list their two
+// daughter cells first. Parsing is a single pass over the input with an
+// explicit stack, so it takes linear time and memory however deep the trees.
+class NewickParser {
+public:
+  explicit NewickParser(std::string_view s)
+    : s(s) { }
+
+  // Parse one tree, ending at ';' or the end of input, into the forest, with
+  // the root born at the given time. Returns the index of the root.
+  uint32_t tree(Forest &forest, double time) {
+    // inner nodes whose daughters are still being parsed
+    struct Open {
+      uint32_t children[2];
+      int n_children;
+    };
+    std::vector<Open> open;
+    uint32_t first = forest.nodes.size();
+    uint32_t root = no_node;
+
+    // birthtime holds the lifetime until the whole tree is known
+    auto attach = [&](uint32_t node) {
+      if (open.empty()) {
+        if (root != no_node)
+          fail("more than one root");
+        root = node;
+      } else {
+        Open &parent = open.back();
+        if (parent.n_children == 2)
+          fail("more than two daughters");
+        parent.children[parent.n_children++] = node;
+      }
+    };
+
+    skip_space();
+    while (pos < s.size() && s[pos] != ';') {
+      char c = s[pos];
+      if (c == '(') {
+        open.push_back(Open{{no_node, no_node}, 0});
+        ++pos;
+      } else if (c == ',') {
+        if (open.empty() || open.back().n_children != 1)
+          fail("unexpected ','");
+        ++pos;
+      } else if (c == ')') {
+        if (open.empty() || open.back().n_children != 2)
+          fail("unexpected ')'");
+        ++pos;
+        uint32_t branch = info(forest);
+        forest.nodes[branch].left = open.back().children[0];
+        forest.nodes[branch].right = open.back().children[1];
+        open.pop_back();
+        attach(branch);
+      } else {
+        attach(info(forest));
+      }
+      skip_space();
+    }
+    if (!open.empty() || root == no_node)
+      fail("incomplete tree");
+
+    // turn lifetimes into absolute times, top down, i.e. from the root (the
+    // last node) backwards
+    forest.nodes[root].birthtime += time;
+    for (uint32_t i = root + 1; i-- > first; ) {
+      const Node &n = forest.nodes[i];
+      if (!n.leaf()) {
+        forest.nodes[n.left].birthtime += n.birthtime;
+        forest.nodes[n.right].birthtime += n.birthtime;
+      }
+    }
+    forest.roots.push_back(root);
+    return root;
+  }
+
+  // Parse all ';' separated trees
+  Forest forest() {
+    Forest forest;
+    // roughly one node per ten characters, reserve to avoid most regrowth
+    forest.nodes.reserve(s.size() / 10);
+    while (true) {
+      skip_space();
+      if (pos == s.size() || s[pos] == ';')
+        break;
+      tree(forest, 0.0);
+      if (pos < s.size())
+        ++pos; // the ';'
+    }
+    return forest;
+  }
+
+private:
+  // Parse "T:dt" into a new node with type T and birthtime dt
+  uint32_t info(Forest &forest) {
+    if (pos + 2 > s.size() || s[pos] < 'A' || s[pos] > 'Z' || s[pos + 1] != ':')
+      fail("expected type:time");
+    uint32_t type = static_cast<uint32_t>(s[pos] - 'A');
+    double dt;
+    auto r = std::from_chars(s.data() + pos + 2, s.data() + s.size(), dt);
+    if (r.ec != std::errc())
+      fail("expected a number");
+    pos = r.ptr - s.data();
+    if (forest.nodes.size() >= no_node)
+      fail("too many cells");
+    forest.nodes.push_back(Node{dt, no_node, no_node, type});
+    return forest.nodes.size() - 1;
+  }
+
+  void skip_space() {
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\n' || s[pos] == '\r' || s[pos] == '\t'))
+      ++pos;
+  }
+
+  [[noreturn]] void fail(const std::string &what) const {
+    throw std::runtime_error("forest parse error at character " + std::to_string(pos) + ": " + what);
+  }
+
+  std::string_view s;
+  size_t pos = 0;
+};
+
+
+inline uint32_t parse_tree(Forest &forest, std::string_view s, double time) {
+  return NewickParser(s).tree(forest, time);
+}
+
+inline Forest parse_forest(std::string_view s) {
+  return NewickParser(s).forest();
+}
+
+
+// Writes trees in the format NewickParser reads, through a large buffer. A
+// tree is written in one pass over its nodes with an explicit stack, so it
+// takes no more memory than its depth however large it is. The nodes may be
+// in any order, as long as daughters are nodes of the same vector.
+class NewickWriter {
+public:
+  explicit NewickWriter(std::ostream &out)
+    : out(out)
+    , buffer(1 << 20) { }
+
+  ~NewickWriter() {
+    flush();
+  }
+
+  // Write the tree under root, which was born at the given time, and its ';'
+  void tree(const std::vector<Node> &nodes, uint32_t root, double time) {
+    // inner nodes whose daughters are being written, with their own
+    // birth times
+    struct Open {
+      uint32_t node;
+      double born;
+      bool right;
+    };
+    std::vector<Open> open;
+    uint32_t node = root;
+    double born = time;
+    while (true) {
+      // down the left daughters to a leaf
+      while (!nodes[node].leaf()) {
+        reserve(1);
+        buffer[used++] = '(';
+        open.push_back(Open{node, born, false});
+        born = nodes[node].birthtime;
+        node = nodes[node].left;
+      }
+      info(nodes[node], born);
+      // up to the first inner node whose right daughter is still to come
+      while (!open.empty() && open.back().right) {
+        reserve(1);
+        buffer[used++] = ')';
+        info(nodes[open.back().node], open.back().born);
+        open.pop_back();
+      }
+      if (open.empty())
+        break;
+      reserve(1);
+      buffer[used++] = ',';
+      open.back().right = true;
+      born = nodes[open.back().node].birthtime;
+      node = nodes[open.back().node].right;
+    }
+    reserve(1);
+    buffer[used++] = ';';
+  }
+
+  void flush() {
+    out.write(buffer.data(), used);
+    used = 0;
+  }
+
+private:
+  // "T:dt" with the shortest lifetime that reads back exactly
+  void info(const Node &n, double born) {
+    reserve(40);
+    buffer[used++] = static_cast<char>('A' + n.type);
+    buffer[used++] = ':';
+    used = std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), n.birthtime - born).ptr - buffer.data();
+  }
+
+  void reserve(size_t n) {
+    if (used + n > buffer.size())
+      flush();
+  }
+
+  std::ostream &out;
+  std::vector<char> buffer;
+  size_t used = 0;
+};
+
+
+#endif
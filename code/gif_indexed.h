@@ -0,0 +1,311 @@
+#ifndef GIF_INDEXED_H
+#define GIF_INDEXED_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Writer for animated GIFs whose frames are already given as indices into a
+// fixed palette of at most 256 colours. The palette is written once as the
+// global colour table and frames are only LZW compressed, so there is no
+// colour quantization or dithering as in a general RGBA GIF writer.
+// After the first frame, only the rectangle of pixels that changed since the
+// previous frame is written, with the unchanged pixels in it transparent when
+// that compresses better (unless deltas is false, then every frame is written
+// whole). A filename of "-" writes to stdout.
+class IndexedGifWriter {
+public:
+  typedef std::array<uint8_t, 3> Colour;
+
+  // delay is the time between frames in hundredths of a second, a delay of 0
+  // makes a still image instead of a looping animation
+  IndexedGifWriter(const std::string &filename, int width, int height
+                   , const std::vector<Colour> &palette, int delay, bool deltas = true)
+    : width(width)
+    , height(height)
+    , delay(delay)
+    , deltas(deltas) {
+    if (palette.empty() || palette.size() > 256)
+      throw std::runtime_error("a gif palette has 1 to 256 colours");
+    // one more colour as the transparent index, if there is room for it
+    n_colours = palette.size();
+    transparent = n_colours < 256 ? n_colours : -1;
+    while ((1u << table_bits) < n_colours + (transparent >= 0 ? 1 : 0))
+      ++table_bits;
+    min_code_size = std::max(table_bits, 2);
+    dictionary.resize(4096 << min_code_size);
+
+    if (filename == "-") {
+      f = stdout;
+    } else {
+      f = std::fopen(filename.c_str(), "wb");
+      if (f == nullptr)
+        throw std::runtime_error("cannot open " + filename);
+    }
+
+    write("GIF89a");
+    put16(width);
+    put16(height);
+    write_byte(0x80 | ((table_bits - 1) << 4) | (table_bits - 1)); // global colour table
+    write_byte(0); // background colour
+    write_byte(0); // pixel aspect ratio
+    for (size_t i = 0; i < (1u << table_bits); ++i) {
+      Colour c = i < n_colours ? palette[i] : Colour{0, 0, 0};
+      write(c.data(), 3);
+    }
+
+    if (delay != 0) {
+      // loop forever
+      write("\x21\xff\x0bNETSCAPE2.0\x03\x01");
+      put16(0);
+      write_byte(0);
+    }
+  }
+
+  ~IndexedGifWriter() {
+    // errors are only reported by an explicit finish()
+    if (f != nullptr) {
+      try {
+        finish();
+      } catch (std::runtime_error &) { }
+    }
+  }
+
+  IndexedGifWriter(const IndexedGifWriter &) = delete;
+  IndexedGifWriter &operator=(const IndexedGifWriter &) = delete;
+
+  // Append a frame of width * height palette indices, row by row
+  void write_frame(const uint8_t *pixels) {
+    put_frame(pixels);
+    if (std::ferror(f))
+      throw std::runtime_error("error writing gif frame");
+  }
+
+  // Bytes written so far
+  uint64_t bytes() const {
+    return written;
+  }
+
+  void finish() {
+    write_byte(0x3b);
+    bool failed = std::ferror(f) != 0;
+    if (f != stdout)
+      failed = std::fclose(f) != 0 || failed;
+    else
+      failed = std::fflush(f) != 0 || failed;
+    f = nullptr;
+    if (failed)
+      throw std::runtime_error("error writing gif");
+  }
+
+private:
+  void put_frame(const uint8_t *pixels) {
+    size_t n = static_cast<size_t>(width) * height;
+    if (previous.empty() || !deltas) {
+      compress(pixels, n, encoded);
+      put_image(0, 0, width, height, false, encoded);
+      previous.assign(pixels, pixels + n);
+      return;
+    }
+
+    // bounding rectangle of the changed pixels
+    int top = 0;
+    while (top < height && row_equal(pixels, top))
+      ++top;
+    if (top == height) {
+      // nothing changed, but the frame is still needed for its delay
+      uint8_t p = transparent >= 0 ? transparent : pixels[0];
+      compress(&p, 1, encoded);
+      put_image(0, 0, 1, 1, transparent >= 0, encoded);
+      return;
+    }
+    int bottom = height - 1;
+    while (row_equal(pixels, bottom))
+      --bottom;
+    int left = width;
+    int right = -1;
+    for (int y = top; y <= bottom; ++y) {
+      const uint8_t *now = pixels + static_cast<size_t>(y) * width;
+      const uint8_t *before = previous.data() + static_cast<size_t>(y) * width;
+      int x = 0;
+      while (x < left && now[x] == before[x])
+        ++x;
+      left = x;
+      x = width - 1;
+      while (x > right && now[x] == before[x])
+        --x;
+      right = x;
+    }
+
+    // the changed rectangle as it is, and with the pixels that didn't change
+    // transparent: which one compresses better depends on how much moved, so
+    // both are tried
+    int w = right - left + 1;
+    int h = bottom - top + 1;
+    patch.resize(static_cast<size_t>(w) * h);
+    masked.resize(patch.size());
+    for (int y = 0; y < h; ++y) {
+      size_t row = static_cast<size_t>(top + y) * width + left;
+      for (int x = 0; x < w; ++x) {
+        uint8_t p = pixels[row + x];
+        patch[y*w + x] = p;
+        masked[y*w + x] = p == previous[row + x] ? transparent : p;
+      }
+      std::memcpy(previous.data() + row, pixels + row, w);
+    }
+    compress(patch.data(), patch.size(), encoded);
+    if (transparent >= 0) {
+      compress(masked.data(), masked.size(), encoded_masked);
+      if (encoded_masked.size() < encoded.size()) {
+        put_image(left, top, w, h, true, encoded_masked);
+        return;
+      }
+    }
+    put_image(left, top, w, h, false, encoded);
+  }
+
+  bool row_equal(const uint8_t *pixels, int y) const {
+    size_t row = static_cast<size_t>(y) * width;
+    return std::memcmp(pixels + row, previous.data() + row, width) == 0;
+  }
+
+  // Write a w x h image at (x, y), using the global colour table and leaving
+  // the previous frame in place, with its compressed data
+  void put_image(int x, int y, int w, int h, bool with_transparency, const std::vector<uint8_t> &data) {
+    write("\x21\xf9\x04");
+    write_byte(with_transparency ? 0x05 : 0x04);
+    put16(delay);
+    write_byte(with_transparency ? transparent : 0);
+    write_byte(0);
+
+    write_byte(0x2c);
+    put16(x);
+    put16(y);
+    put16(w);
+    put16(h);
+    write_byte(0);
+
+    write(data.data(), data.size());
+  }
+
+  // LZW compress n pixels into image data sub-blocks in out. The dictionary
+  // entry (code << min_code_size) + p is the code of the string `code`
+  // followed by pixel p, or 0 if that string has no code yet.
+  void compress(const uint8_t *pixels, size_t n, std::vector<uint8_t> &out) {
+    const uint32_t clear_code = 1u << min_code_size;
+    const uint32_t end_code = clear_code + 1;
+    out.clear();
+    out.push_back(min_code_size);
+    block_start = out.size();
+    out.push_back(0);
+
+    std::fill(dictionary.begin(), dictionary.end(), 0);
+    code_size = min_code_size + 1;
+    uint32_t last_code = end_code;
+    put_code(clear_code, out);
+
+    uint32_t prefix = pixels[0];
+    for (size_t i = 1; i < n; ++i) {
+      uint16_t &next = dictionary[(prefix << min_code_size) + pixels[i]];
+      if (next != 0) {
+        prefix = next;
+        continue;
+      }
+      put_code(prefix, out);
+      next = ++last_code;
+      if (last_code >= (1u << code_size))
+        ++code_size;
+      if (last_code == 4095) {
+        // the dictionary is full, start over
+        put_code(clear_code, out);
+        std::fill(dictionary.begin(), dictionary.end(), 0);
+        code_size = min_code_size + 1;
+        last_code = end_code;
+      }
+      prefix = pixels[i];
+    }
+    put_code(prefix, out);
+    put_code(end_code, out);
+
+    if (n_bits > 0)
+      put_byte(static_cast<uint8_t>(bits), out);
+    bits = 0;
+    n_bits = 0;
+    if (out.size() == block_start + 1)
+      out.pop_back(); // empty last sub-block
+    else
+      out[block_start] = out.size() - block_start - 1;
+    out.push_back(0); // block terminator
+  }
+
+  void put_code(uint32_t code, std::vector<uint8_t> &out) {
+    bits |= code << n_bits;
+    n_bits += code_size;
+    while (n_bits >= 8) {
+      put_byte(static_cast<uint8_t>(bits), out);
+      bits >>= 8;
+      n_bits -= 8;
+    }
+  }
+
+  // Append a byte to the current sub-block, of at most 255 bytes after its
+  // length byte at block_start
+  void put_byte(uint8_t b, std::vector<uint8_t> &out) {
+    out.push_back(b);
+    if (out.size() - block_start == 256) {
+      out[block_start] = 255;
+      block_start = out.size();
+      out.push_back(0);
+    }
+  }
+
+  void put16(int v) {
+    write_byte(v & 0xff);
+    write_byte((v >> 8) & 0xff);
+  }
+
+  void write_byte(int b) {
+    std::fputc(b, f);
+    ++written;
+  }
+
+  void write(const void *data, size_t n) {
+    std::fwrite(data, 1, n, f);
+    written += n;
+  }
+
+  void write(const char *s) {
+    write(s, std::strlen(s));
+  }
+
+  std::FILE *f = nullptr;
+  uint64_t written = 0;
+  int width;
+  int height;
+  int delay;
+  bool deltas;
+  size_t n_colours;
+  int transparent;
+  int table_bits = 1;
+  int min_code_size;
+  std::vector<uint16_t> dictionary;
+  std::vector<uint8_t> previous;
+  std::vector<uint8_t> patch;
+  std::vector<uint8_t> masked;
+  std::vector<uint8_t> encoded;
+  std::vector<uint8_t> encoded_masked;
+
+  int code_size = 0;
+  uint32_t bits = 0;
+  int n_bits = 0;
+  size_t block_start = 0;
+};
+
+
+#endif
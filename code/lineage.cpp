@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <tclap/CmdLine.h>
+
+#include "forest.h"
+#include "stats.h"
+
+
+using namespace std;
+
+
+const string VERSION = "0.0.0";
+
+
+// Stochastic birth-death process of cells of K types. A cell of type k
+// divides at rate max(0, b_k - p_k N) and dies at rate d_k + q_k N, where N is
+// the number of live cells. Each daughter mutates to one of the other types
+// with probability u. Every starting cell is the root of a tree, written as
+// Newick for particles (see forest.h) once all of its cells are dead, or at
+// the end time.
+
+struct Arguments {
+  double end_time;
+  double mutation_rate;
+  vector<double> birth_rate;
+  vector<double> death_rate;
+  vector<double> birth_interaction;
+  vector<double> death_interaction;
+  vector<size_t> starting_population;
+  size_t leap_threshold;
+  double leap_epsilon;
+  uint64_t seed;
+  bool stats;
+  string trace;
+};
+
+
+template<typename T>
+bool parse_list(const string &s, vector<T> &v) {
+  istringstream in(s);
+  T x;
+  v.clear();
+  while (in >> x)
+    v.push_back(x);
+  return in.eof() && !v.empty();
+}
+
+
+// The live cells of each type, in no particular order, so that a uniformly
+// random one can be drawn and any one removed in constant time
+struct Population {
+  explicit Population(size_t n_types)
+    : cells(n_types) { }
+
+  vector< vector<uint32_t> > cells;
+  vector<uint32_t> position;   // of node i in cells[type of i], while alive
+  size_t size = 0;
+
+  void add(uint32_t node, uint32_t type) {
+    if (position.size() <= node)
+      position.resize(node + 1);
+    position[node] = cells[type].size();
+    cells[type].push_back(node);
+    ++size;
+  }
+
+  void remove(uint32_t node, uint32_t type) {
+    vector<uint32_t> &c = cells[type];
+    uint32_t last = c.back();
+    c[position[node]] = last;
+    position[last] = position[node];
+    c.pop_back();
+    --size;
+  }
+};
+
+
+int main(int argc, char **argv) {
+
+  Arguments a;
+  try {
+    TCLAP::CmdLine cmd("Birth-death process with mutations, written as a Newick forest", ' ', VERSION);
+
+    TCLAP::ValueArg<double> a_end_time("t", "endtime", "Time to simulate", false, 10.0, "double", cmd);
+    TCLAP::ValueArg<double> a_mutation_rate("u", "mutation-rate", "Probability that a daughter cell has another type than its mother", false, 0.0, "double", cmd);
+    TCLAP::ValueArg<string> a_birth_rate("b", "birth-rate", "Division rate of each type", true, "", "space separated rates", cmd);
+    TCLAP::ValueArg<string> a_death_rate("d", "death-rate", "Death rate of each type", true, "", "space separated rates", cmd);
+    TCLAP::ValueArg<string> a_birth_interaction("p", "birth-interaction", "Decrease of the division rate of each type per live cell", false, "", "space separated rates", cmd);
+    TCLAP::ValueArg<string> a_death_interaction("q", "death-interaction", "Increase of the death rate of each type per live cell", false, "", "space separated rates", cmd);
+    TCLAP::ValueArg<string> a_starting_population("n", "starting-population", "Number of cells of each type at time 0", false, "1", "space separated counts", cmd);
+    TCLAP::ValueArg<size_t> a_leap_threshold("L", "leap-threshold", "Take tau-leaping steps while there are at least this many cells (0 for exact simulation throughout)", false, 0, "integer", cmd);
+    TCLAP::ValueArg<double> a_leap_epsilon("E", "leap-epsilon", "Expected number of events per cell in a tau-leaping step", false, 0.01, "double", cmd);
+    TCLAP::ValueArg<uint64_t> a_seed("S", "seed", "Seed of the random numbers (random if not given)", false, 0, "integer", cmd);
+    TCLAP::SwitchArg a_stats("", "stats", "Print the time spent in each phase and other counts to stderr at the end", cmd);
+    TCLAP::ValueArg<string> a_trace("", "trace", "Write the phases as a Chrome trace event file (for chrome://tracing or ui.perfetto.dev)", false, "", "filename", cmd);
+
+    cmd.parse(argc, argv);
+
+    a.end_time = a_end_time.getValue();
+    a.mutation_rate = a_mutation_rate.getValue();
+    a.leap_threshold = a_leap_threshold.getValue();
+    a.leap_epsilon = a_leap_epsilon.getValue();
+    if (a_seed.isSet()) {
+      a.seed = a_seed.getValue();
+    } else {
+      random_device rd;
+      a.seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+    a.stats = a_stats.getValue();
+    a.trace = a_trace.getValue();
+    if (!stats::enable(a.stats, a.trace))
+      cerr << "this build has no --stats or --trace (built with NO_STATS)" << endl;
+
+    if (!parse_list(a_birth_rate.getValue(), a.birth_rate) || !parse_list(a_death_rate.getValue(), a.death_rate)
+        || !parse_list(a_starting_population.getValue(), a.starting_population)) {
+      cerr << "rates and the starting population must be space separated numbers" << endl;
+      return 1;
+    }
+    // no interaction unless given
+    size_t n_types = a.birth_rate.size();
+    a.birth_interaction.assign(n_types, 0.0);
+    a.death_interaction.assign(n_types, 0.0);
+    if ((a_birth_interaction.isSet() && !parse_list(a_birth_interaction.getValue(), a.birth_interaction))
+        || (a_death_interaction.isSet() && !parse_list(a_death_interaction.getValue(), a.death_interaction))) {
+      cerr << "rates must be space separated numbers" << endl;
+      return 1;
+    }
+    if (n_types > 26 || a.death_rate.size() != n_types || a.birth_interaction.size() != n_types
+        || a.death_interaction.size() != n_types || a.starting_population.size() > n_types) {
+      cerr << "give the same number of rates (at most 26) for every type, and no more starting counts" << endl;
+      return 1;
+    }
+    a.starting_population.resize(n_types, 0);
+    for (size_t k = 0; k < n_types; ++k) {
+      if (!(a.birth_rate[k] >= 0.0 && a.death_rate[k] >= 0.0
+            && a.birth_interaction[k] >= 0.0 && a.death_interaction[k] >= 0.0)) {
+        cerr << "rates can't be negative" << endl;
+        return 1;
+      }
+    }
+    if (!(a.mutation_rate >= 0.0 && a.mutation_rate <= 1.0)) {
+      cerr << "mutation rate must be a probability" << endl;
+      return 1;
+    }
+    if (!(a.end_time >= 0.0)) {
+      cerr << "end time can't be negative" << endl;
+      return 1;
+    }
+    if (!(a.leap_epsilon > 0.0)) {
+      cerr << "leap epsilon must be positive" << endl;
+      return 1;
+    }
+
+  } catch (TCLAP::ArgException &e) {
+    cerr << "TCLAP Error: " << e.error() << endl << "\targ: " << e.argId() << endl;
+    return 1;
+  }
+
+  const size_t n_types = a.birth_rate.size();
+  mt19937_64 rng(a.seed);
+  uniform_real_distribution<double> uniform(0.0, 1.0);
+  // poisson_distribution needs a positive mean, with a rate of 0 there are
+  // no events
+  auto poisson = [&](double mean) -> size_t {
+    return mean > 0.0 ? poisson_distribution<size_t>(mean)(rng) : 0;
+  };
+
+  // every cell is a node, whose birthtime is when it divides or dies (see
+  // forest.h); tree[i] is the starting cell that node i descends from
+  vector<Node> nodes;
+  vector<uint32_t> tree;
+  vector<uint32_t> roots;
+  vector<size_t> tree_size;    // live cells of each tree
+  Population population(n_types);
+  for (size_t k = 0; k < n_types; ++k) {
+    for (size_t i = 0; i < a.starting_population[k]; ++i) {
+      uint32_t node = nodes.size();
+      nodes.push_back(Node{a.end_time, no_node, no_node, static_cast<uint32_t>(k)});
+      tree.push_back(roots.size());
+      roots.push_back(node);
+      tree_size.push_back(1);
+      population.add(node, k);
+    }
+  }
+
+  NewickWriter out(cout);
+  vector<bool> written(roots.size(), false);
+
+  auto mutate = [&](uint32_t type) {
+    if (n_types < 2 || uniform(rng) >= a.mutation_rate)
+      return type;
+    stats::count("mutations", 1);
+    // one of the other types, uniformly
+    uint32_t other = static_cast<uint32_t>(uniform(rng) * (n_types - 1));
+    return min(other, static_cast<uint32_t>(n_types - 2)) + (other >= type ? 1 : 0);
+  };
+
+  auto divide = [&](uint32_t node, double time) {
+    uint32_t type = nodes[node].type;
+    population.remove(node, type);
+    nodes[node].birthtime = time;
+    uint32_t daughters[2];
+    for (uint32_t &d: daughters) {
+      d = nodes.size();
+      uint32_t t = mutate(type);
+      nodes.push_back(Node{a.end_time, no_node, no_node, t});
+      tree.push_back(tree[node]);
+      population.add(d, t);
+    }
+    nodes[node].left = daughters[0];
+    nodes[node].right = daughters[1];
+    ++tree_size[tree[node]];
+    stats::count("divisions", 1);
+  };
+
+  auto die = [&](uint32_t node, double time) {
+    population.remove(node, nodes[node].type);
+    nodes[node].birthtime = time;
+    stats::count("deaths", 1);
+    // an extinct tree is complete, so it can be written now
+    uint32_t t = tree[node];
+    if (--tree_size[t] == 0) {
+      stats::Timer timer("output");
+      out.tree(nodes, roots[t], 0.0);
+      written[t] = true;
+    }
+  };
+
+  // division and death rates of a cell of type k with n cells alive
+  auto birth_rate = [&](size_t k, size_t n) {
+    return max(0.0, a.birth_rate[k] - a.birth_interaction[k] * n);
+  };
+  auto death_rate = [&](size_t k, size_t n) {
+    return a.death_rate[k] + a.death_interaction[k] * n;
+  };
+
+  // tau-leaping: the events of a step of length tau, from the rates at its start
+  struct LeapEvent {
+    double time;
+    uint32_t node;
+    bool division;
+    bool operator<(const LeapEvent &other) const { return time < other.time; }
+  };
+  vector<LeapEvent> leap;
+  size_t n_leaps = 0;
+
+  vector<double> type_rate(n_types);
+  double time = 0.0;
+  {
+    stats::Timer timer("simulate");
+    while (population.size > 0) {
+      // both daughters of every division are new nodes
+      if (nodes.size() + 2 * population.size >= no_node) {
+        cerr << "too many cells for the forest (" << nodes.size() << ") at time " << time << endl;
+        return 1;
+      }
+      size_t n = population.size;
+      if (a.leap_threshold > 0 && n >= a.leap_threshold) {
+        // a step in which a cell has about epsilon events, or fewer
+        double max_rate = 0.0;
+        for (size_t k = 0; k < n_types; ++k) {
+          if (!population.cells[k].empty())
+            max_rate = max(max_rate, birth_rate(k, n) + death_rate(k, n));
+        }
+        if (max_rate == 0.0) {
+          time = a.end_time;
+          break;
+        }
+        double tau = min(a.leap_epsilon / max_rate, a.end_time - time);
+        // the events of each type fall on distinct cells alive at the start
+        // of the step, drawn by a partial Fisher-Yates shuffle of its cells
+        leap.clear();
+        for (size_t k = 0; k < n_types; ++k) {
+          vector<uint32_t> &cells = population.cells[k];
+          size_t n_k = cells.size();
+          if (n_k == 0)
+            continue;
+          size_t n_divisions = poisson(n_k * birth_rate(k, n) * tau);
+          size_t n_deaths = poisson(n_k * death_rate(k, n) * tau);
+          size_t n_events = min(n_divisions + n_deaths, n_k);
+          for (size_t i = 0; i < n_events; ++i) {
+            size_t j = i + static_cast<size_t>(uniform(rng) * (n_k - i));
+            j = min(j, n_k - 1);
+            swap(cells[i], cells[j]);
+            population.position[cells[i]] = i;
+            population.position[cells[j]] = j;
+            // when there are more events than cells, as many of each kind
+            // are dropped as in a random choice
+            bool division = uniform(rng) * (n_divisions + n_deaths) < n_divisions;
+            leap.push_back(LeapEvent{time + uniform(rng) * tau, cells[i], division});
+          }
+        }
+        sort(leap.begin(), leap.end());
+        for (const LeapEvent &e: leap) {
+          if (e.division)
+            divide(e.node, e.time);
+          else
+            die(e.node, e.time);
+        }
+        time += tau;
+        ++n_leaps;
+        if (time >= a.end_time)
+          break;
+        continue;
+      }
+
+      // Gillespie's direct method: the rates of all cells of a type are the
+      // same, so an event picks a type in O(K) and then a cell in O(1). The
+      // rates depend on the number of cells, so they change at every event.
+      double total = 0.0;
+      for (size_t k = 0; k < n_types; ++k) {
+        type_rate[k] = population.cells[k].size() * (birth_rate(k, n) + death_rate(k, n));
+        total += type_rate[k];
+      }
+      if (total == 0.0) {
+        time = a.end_time;
+        break;
+      }
+      time += -log1p(-uniform(rng)) / total;
+      if (time >= a.end_time)
+        break;
+      double r = uniform(rng) * total;
+      size_t k = 0;
+      while (k + 1 < n_types && (r >= type_rate[k] || population.cells[k].empty())) {
+        r -= type_rate[k];
+        ++k;
+      }
+      const vector<uint32_t> &cells = population.cells[k];
+      // rounding in r can run past the last type with cells onto one without
+      // any: no event then
+      if (cells.empty())
+        continue;
+      double per_cell = birth_rate(k, n) + death_rate(k, n);
+      size_t i = min(static_cast<size_t>(r / per_cell), cells.size() - 1);
+      // the remainder within the cell's share picks division or death
+      if (r - i * per_cell < birth_rate(k, n))
+        divide(cells[i], time);
+      else
+        die(cells[i], time);
+    }
+  }
+
+  {
+    // the trees still alive, whose live cells end at the end time
+    stats::Timer timer("output");
+    for (size_t t = 0; t < roots.size(); ++t) {
+      if (!written[t])
+        out.tree(nodes, roots[t], 0.0);
+    }
+    out.flush();
+    cout << endl;
+  }
+
+  stats::count("cells", nodes.size());
+  stats::count("tau-leaping steps", n_leaps);
+  stats::count("live cells at the end", population.size);
+  if (!stats::finish(cerr)) {
+    cerr << "cannot write trace " << a.trace << endl;
+    return 1;
+  }
+}
@@ -1,16 +1,28 @@
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
-#include <regex>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <string>
 
 #include <tclap/CmdLine.h>
 
-// Requires gif.h: https://github.com/ginsweater/gif-h
-#include "gif.h"
+#include "gif_indexed.h"
+#include "raw_video.h"
+#include "render.h"
+#include "stats.h"
+#include "trajectory.h"
 
 
 using namespace std;
@@ -26,44 +38,22 @@ double max_y = numeric_limits<double>::lowest();
 size_t max_type = 0;
 
 
-struct Point {
-  double x;
-  double y;
-  size_t type;
-};
-
+// The points of a frame are either read into points, or are the records of a
+// memory mapped binary trajectory at mapped, used in place
 struct Frame {
   double time;
   vector<Point> points;
-};
+  const TrajectoryPoint *mapped = nullptr;
+  size_t n_mapped = 0;
 
-vector<Frame> parse_input(string filename) {
-  fstream f;
-  f.open(filename, fstream::in);
-  string s;
-  regex re_time(R"((\d+.?\d*e?-?\d*))");
-  regex re_point(R"(([A-Z])\((-?\d+.?\d*e?-?\d*), (-?\d+.?\d*e?-?\d*)\))");
-  vector<Frame> frames;
-  while (getline(f, s)) {
-    Frame frame;
-    smatch m;
-    regex_search(s, m, re_time);
-    frame.time = stod(m[1]);
-    while (regex_search(s, m, re_point)) {
-      size_t type = static_cast<size_t>(string(m[1])[0] - 'A');
-      double x = stod(m[2]);
-      double y = stod(m[3]);
-      min_x = min(min_x, x);
-      max_x = max(max_x, x);
-      min_y = min(min_y, y);
-      max_y = max(max_y, y);
-      max_type = max(type, max_type);
-      frame.points.push_back(Point{x, y, type});
-      s = m.suffix().str();
-    }
-    frames.push_back(frame);
+  size_t size() const {
+    return mapped ? n_mapped : points.size();
   }
+};
 
+
+// Widen the bounds of all points a little, so cells at the edge are whole
+void pad_bounds() {
   double wx = (max_x - min_x) / 20.0;
   double wy = (max_y - min_y) / 20.0;
 
@@ -71,8 +61,32 @@ vector<Frame> parse_input(string filename) {
   max_x += wx;
   min_y -= wy;
   max_y += wy;
+}
 
-  return frames;
+void set_bounds(const TrajectoryBounds &b) {
+  min_x = b.min_x;
+  max_x = b.max_x;
+  min_y = b.min_y;
+  max_y = b.max_y;
+  max_type = b.max_type;
+}
+
+
+// Read the next frame of a text trajectory, false at the end
+bool read_frame(TextTrajectoryReader &in, Frame &frame) {
+  frame.points.clear();
+  return in.next(frame.time, [&](double x, double y, unsigned type) {
+      frame.points.push_back(Point{x, y, type});
+    });
+}
+
+// Bounds of all points of a text trajectory, by reading all of it
+TrajectoryBounds scan_bounds(TextTrajectoryReader &in) {
+  TrajectoryBounds b;
+  double time;
+  while (in.next(time, [&](double x, double y, unsigned type) { b.add(x, y, type); }))
+    ;
+  return b;
 }
 
 
@@ -83,6 +97,12 @@ struct Arguments {
   int height;
   int delay;
   int frameskip;
+  int threads;
+  double motion_tolerance;
+  string format;
+  string bounds;
+  bool stats;
+  string trace;
 };
 
 
@@ -99,42 +119,135 @@ double field2(double r) {
 double efield(double r) {
   return max(0.0, exp(-r * 1000.0));
 }
-double cfield(double r) {
-  if (r < 0.0001) {
-    return 1.0 - r;
-  } else {
-    return 0.0;
-    // return max(0.0, 1.0 - (r-0.0001)*2000);
+
+
+// Render the frames given by read on n_threads threads, while the calling
+// thread hands the finished frames to write in order. Frames are read one at a
+// time into a fixed set of slots, so at most a few frames per thread are in
+// memory at once. render is told which thread it runs on. write returns false
+// to stop early, then the threads are joined and false is returned.
+bool render_pipeline(int n_threads, size_t buffer_size
+                     , function<bool(Frame &)> read
+                     , function<void(const Frame &, vector<uint8_t> &, int)> render
+                     , function<bool(size_t, const vector<uint8_t> &)> write) {
+  struct Slot {
+    Frame frame;
+    vector<uint8_t> pixels;
+  };
+  vector<Slot> slots(n_threads + 2);
+  vector<Slot *> free_slots;
+  for (auto &s: slots) {
+    s.pixels.resize(buffer_size);
+    free_slots.push_back(&s);
   }
-  // return (r < 0.0002 ? 1.0 : 0.0);
-}
-double tfield(double r) {
-  if (r < 0.0001) {
-    return 1.0;
-  } else {
-    return max(0.0, 1.0 - (r-0.0001)*30.0);
+  map<size_t, Slot *> finished;
+  mutex m;
+  condition_variable slot_freed;
+  condition_variable frame_finished;
+  bool done = false;
+  size_t n_frames = 0;
+
+  // frames are numbered in the order they are read, while holding read_lock
+  mutex read_lock;
+  size_t next_frame = 0;
+  bool exhausted = false;
+
+  auto work = [&](int t) {
+    while (true) {
+      Slot *slot;
+      {
+        unique_lock<mutex> lock(m);
+        slot_freed.wait(lock, [&]() { return !free_slots.empty() || done; });
+        if (done)
+          return;
+        slot = free_slots.back();
+        free_slots.pop_back();
+      }
+      size_t k;
+      bool more;
+      {
+        lock_guard<mutex> lock(read_lock);
+        k = next_frame;
+        more = !exhausted && read(slot->frame);
+        if (more)
+          ++next_frame;
+        else
+          exhausted = true;
+      }
+      if (!more) {
+        {
+          lock_guard<mutex> lock(m);
+          free_slots.push_back(slot);
+          done = true;
+          n_frames = k;
+        }
+        slot_freed.notify_all();
+        frame_finished.notify_all();
+        return;
+      }
+      render(slot->frame, slot->pixels, t);
+      {
+        lock_guard<mutex> lock(m);
+        finished[k] = slot;
+      }
+      frame_finished.notify_one();
+    }
+  };
+  vector<thread> workers;
+  for (int t = 0; t < n_threads; ++t)
+    workers.emplace_back(work, t);
+
+  bool written = true;
+  for (size_t k = 0; ; ++k) {
+    Slot *slot;
+    {
+      unique_lock<mutex> lock(m);
+      frame_finished.wait(lock, [&]() { return finished.count(k) > 0 || (done && k >= n_frames); });
+      if (finished.count(k) == 0)
+        break;
+      slot = finished[k];
+      finished.erase(k);
+    }
+    written = write(k, slot->pixels);
+    {
+      lock_guard<mutex> lock(m);
+      free_slots.push_back(slot);
+      // the workers stop at their next frame
+      if (!written)
+        done = true;
+    }
+    slot_freed.notify_all();
+    if (!written)
+      break;
   }
-}
-double distance2(const Point &a, const Point &b) {
-  return (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);
-}
-double distance(const Point &a, const Point &b) {
-  return sqrt(distance2(a, b));
-}
 
+  for (auto &t: workers)
+    t.join();
+  return written;
+}
 
 
 int main(int argc, char **argv) {
+  // a reader of the output that goes away (e.g. the encoder at the end of a
+  // pipe) shows as a write error, to stop cleanly, rather than killing us
+  signal(SIGPIPE, SIG_IGN);
+
   Arguments a;
   try {
     TCLAP::CmdLine cmd("General treatment simulator", ' ', VERSION);
 
-    TCLAP::ValueArg<string> a_infile("i", "infile", "Timeline of cell positions", true, "n/a", "file with lines of: \"[Time] [Type]([XCOORD], [YCOORD]), [TYPE]([XCOORD], [YCOORD]), ...\"", cmd);
-    TCLAP::ValueArg<string> a_outfile("o", "outfile", "Filename of output gif", true, "n/a", "filename", cmd);
+    TCLAP::ValueArg<string> a_infile("i", "infile", "Timeline of cell positions, - for stdin", true, "n/a", "binary trajectory, or file with lines of: \"[Time] [Type]([XCOORD], [YCOORD]), [TYPE]([XCOORD], [YCOORD]), ...\"", cmd);
+    TCLAP::ValueArg<string> a_outfile("o", "outfile", "Filename of output gif or video stream, - for stdout", true, "n/a", "filename", cmd);
     TCLAP::ValueArg<int> a_width("x", "width", "Width of output in pixels", false, 640, "integer", cmd);
     TCLAP::ValueArg<int> a_height("y", "height", "Height of output in pixels", false, 480, "integer", cmd);
-    TCLAP::ValueArg<int> a_delay("d", "delay", "Delay between frames in milliseconds", false, 17, "integer", cmd);
+    TCLAP::ValueArg<int> a_delay("d", "delay", "Delay between frames in hundredths of a second", false, 17, "integer", cmd);
     TCLAP::ValueArg<int> a_frameskip("f", "frameskip", "Frames to skip between rendered frames", false, 0, "integer", cmd);
+    TCLAP::ValueArg<int> a_threads("j", "threads", "Number of threads rendering frames (plus one writing the gif)", false, 1, "integer", cmd);
+    TCLAP::ValueArg<string> a_format("F", "format", "Output format: gif, or an uncompressed y4m or ppm stream (see raw_video.h)", false, "gif", "gif|y4m|ppm", cmd);
+    TCLAP::ValueArg<string> a_bounds("b", "bounds", "Part of the plane to show, and the largest cell type (taken from the input if not given). Needed with the max_type to read from stdin, otherwise taken from the input", false, "", "\"min_x max_x min_y max_y [max_type]\"", cmd);
+    TCLAP::ValueArg<double> a_motion_tolerance("m", "motion-tolerance", "Don't render a part of a frame again if its cells moved less than this since it was rendered (0 to only skip parts where nothing moved)", false, 0.0, "double", cmd);
+    TCLAP::SwitchArg a_stats("", "stats", "Print the time spent in each phase and other counts to stderr at the end", cmd);
+    TCLAP::ValueArg<string> a_trace("", "trace", "Write the phases as a Chrome trace event file (for chrome://tracing or ui.perfetto.dev)", false, "", "filename", cmd);
 
     cmd.parse(argc, argv);
 
@@ -144,91 +257,245 @@ int main(int argc, char **argv) {
     a.height = a_height.getValue();
     a.delay = a_delay.getValue();
     a.frameskip = a_frameskip.getValue();
+    a.threads = a_threads.getValue();
+    a.motion_tolerance = a_motion_tolerance.getValue();
+    a.format = a_format.getValue();
+    a.bounds = a_bounds.getValue();
+    a.stats = a_stats.getValue();
+    a.trace = a_trace.getValue();
+    if (!stats::enable(a.stats, a.trace))
+      cerr << "this build has no --stats or --trace (built with NO_STATS)" << endl;
+
+    if (a.threads < 1) {
+      cerr << "need at least one thread" << endl;
+      return 1;
+    }
+    if (a.motion_tolerance < 0.0) {
+      cerr << "motion tolerance can't be negative" << endl;
+      return 1;
+    }
+    if (a.format != "gif" && a.format != "y4m" && a.format != "ppm") {
+      cerr << "unknown output format " << a.format << endl;
+      return 1;
+    }
 
   } catch (TCLAP::ArgException &e) {
     cerr << "TCLAP Error: " << e.error() << endl << "\targ: " << e.argId() << endl;
     return 1;
   }
 
-  auto frames = parse_input(a.infile);
-
-  double xw = (max_x - min_x);
-  double yw = (max_y - min_y);
-
-  cout << min_x << ' ' << max_x << endl;
-  cout << min_y << ' ' << max_y << endl;
-
-  GifWriter gif;
-  GifBegin(&gif, a.outfile.c_str(), a.width, a.height, a.delay);
-
-  vector<uint8_t> buffer(a.width * a.height * 4, 0);
-  cout << buffer.size() << endl;
-
-  for (size_t i = 0; i < frames.size(); i += 1 + a.frameskip) {
-    cout << "\rRendering frame " << i << "/" << frames.size() - 1;
-    cout.flush();
-
-    for (int y = 0; y < a.height; ++y) {
-      for (int x = 0; x < a.width; ++x) {
-        // double *f = new double[max_type + 1];
-        vector<double> f(max_type + 1, 0.0);
-        vector<double> f2(max_type + 1, 0.0);
-        Point here{
-              min_x + static_cast<double>(x) / static_cast<double>(a.width) * xw
-            , min_y + static_cast<double>(y) / static_cast<double>(a.height) * yw
-            , 0
-            };
-        // cout << here.x << ' ' << here.y << endl;
-        for (auto &p: frames[i].points) {
-          f[p.type] += cfield(distance2(here, p));
-          f2[p.type] += tfield(distance(here, p));
+  // Bounds of the picture: given, or from the footer of a binary trajectory,
+  // or from the summary line at the end of a text trajectory, or else found
+  // by reading the input twice. The largest cell type sets the palette, so
+  // when --bounds leaves it out it comes from the input as well.
+  bool have_max_type = false;
+  if (!a.bounds.empty()) {
+    istringstream in(a.bounds);
+    if (!(in >> min_x >> max_x >> min_y >> max_y) || !(min_x < max_x && min_y < max_y)) {
+      cerr << "bounds must be \"min_x max_x min_y max_y [max_type]\"" << endl;
+      return 1;
+    }
+    size_t t;
+    if (in >> t) {
+      max_type = t;
+      have_max_type = true;
+    }
+  }
+
+  // binary trajectory files are used in place through a memory map, other
+  // input is read one frame at a time
+  unique_ptr<MappedTrajectory> trajectory;
+  unique_ptr<TrajectoryReader> binary_in;
+  ifstream file;
+  unique_ptr<TextTrajectoryReader> text_in;
+  try {
+    if (a.infile == "-") {
+      if (!have_max_type) {
+        cerr << "reading from stdin needs --bounds with the max_type" << endl;
+        return 1;
+      }
+      if (cin.peek() == trajectory_magic[0])
+        binary_in = make_unique<TrajectoryReader>(cin);
+      else
+        text_in = make_unique<TextTrajectoryReader>(cin);
+    } else if (is_binary_trajectory(a.infile)) {
+      trajectory = make_unique<MappedTrajectory>(a.infile);
+      if (a.bounds.empty()) {
+        min_x = trajectory->min_x;
+        max_x = trajectory->max_x;
+        min_y = trajectory->min_y;
+        max_y = trajectory->max_y;
+        pad_bounds();
+      }
+      if (!have_max_type)
+        max_type = trajectory->max_type;
+    } else {
+      file.open(a.infile);
+      if (!file) {
+        cerr << "cannot open " << a.infile << endl;
+        return 1;
+      }
+      if (!have_max_type) {
+        TrajectoryBounds b;
+        if (!read_summary(a.infile, b)) {
+          stats::Timer timer("scan bounds");
+          TextTrajectoryReader scan(file);
+          b = scan_bounds(scan);
+          file.clear();
+          file.seekg(0);
         }
-        double total_f = accumulate(f.begin(), f.end(), 0.0);
-        double total_f2 = accumulate(f2.begin(), f2.end(), 0.0);
-        // cout << x << ' ' << y << ' ' << total_f << endl;
-        // cout << y*a.width + x << endl;
-        if (total_f > 0.5) {
-          auto main_type = max_element(f.begin(), f.end()) - f.begin();
-          switch (main_type) {
-          case 0:
-            buffer[(y*a.width + x)*4] = numeric_limits<uint8_t>::max() / 3;
-            buffer[(y*a.width + x)*4 + 1] = 0;
-            buffer[(y*a.width + x)*4 + 2] = numeric_limits<uint8_t>::max();
-            buffer[(y*a.width + x)*4 + 3] = 0;
-            break;
-          case 1:
-            buffer[(y*a.width + x)*4] = numeric_limits<uint8_t>::max();
-            buffer[(y*a.width + x)*4 + 1] = numeric_limits<uint8_t>::max() / 2;
-            buffer[(y*a.width + x)*4 + 2] = 0;
-            buffer[(y*a.width + x)*4 + 3] = 0;
-          }
-        } else if (total_f2 > 0.5) {
-          buffer[(y*a.width + x)*4] = numeric_limits<uint8_t>::max() / 2;
-          buffer[(y*a.width + x)*4 + 1] = numeric_limits<uint8_t>::max() / 2;
-          buffer[(y*a.width + x)*4 + 2] = numeric_limits<uint8_t>::max() / 2;
-          buffer[(y*a.width + x)*4 + 3] = 0;
-        } else {
-          buffer[(y*a.width + x)*4] = numeric_limits<uint8_t>::max();
-          buffer[(y*a.width + x)*4 + 1] = numeric_limits<uint8_t>::max();
-          buffer[(y*a.width + x)*4 + 2] = numeric_limits<uint8_t>::max();
-          buffer[(y*a.width + x)*4 + 3] = 0;
+        max_type = b.max_type;
+        if (a.bounds.empty()) {
+          set_bounds(b);
+          pad_bounds();
         }
-        // if (total_f > 0.5)
-        //   buffer[(y*a.width + x)*4] = numeric_limits<uint8_t>::max();
-        // else
-        //   buffer[(y*a.width + x)*4] = 0;
-        // buffer[(y*a.width + x)*4] = total_f * numeric_limits<uint8_t>::max();
-        // buffer[x*a.height + y] = total_f * numeric_limits<uint8_t>::max();
-        // delete f;
       }
+      text_in = make_unique<TextTrajectoryReader>(file);
     }
-
-    GifWriteFrame(&gif, buffer.data(), a.width, a.height, a.delay);
-    // cout << "frame done" << endl;
-    // SDL_RenderDrawPoint(renderer, (point.x - min_x) / xw * WIDTH, (point.y - min_y) / yw * HEIGHT);
+  } catch (runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
   }
 
-  GifEnd(&gif);
+  // frameskip frames are skipped after every frame that is rendered
+  size_t n_read = 0;
+  vector<TrajectoryPoint> binary_points;
+  function<bool(Frame &)> read_next = [&](Frame &frame) {
+    stats::Timer timer("parse");
+    if (trajectory) {
+      size_t i = n_read * (1 + a.frameskip);
+      if (i >= trajectory->size())
+        return false;
+      frame.time = trajectory->time(i);
+      frame.mapped = trajectory->points(i);
+      frame.n_mapped = trajectory->count(i);
+    } else if (binary_in) {
+      for (int s = 0; n_read > 0 && s < a.frameskip; ++s) {
+        if (!binary_in->skip())
+          return false;
+      }
+      if (!binary_in->next(frame.time, binary_points))
+        return false;
+      frame.points.resize(binary_points.size());
+      for (size_t k = 0; k < frame.points.size(); ++k)
+        frame.points[k] = Point{binary_points[k].x, binary_points[k].y, binary_points[k].type};
+    } else {
+      for (int s = 0; n_read > 0 && s < a.frameskip; ++s) {
+        if (!text_in->skip())
+          return false;
+      }
+      if (!read_frame(*text_in, frame))
+        return false;
+    }
+    auto check_types = [&](const auto *p, size_t n) {
+      for (size_t k = 0; k < n; ++k) {
+        if (p[k].type > max_type)
+          throw runtime_error("cell type " + to_string(p[k].type) + " is beyond the largest type of the bounds");
+      }
+    };
+    if (frame.mapped)
+      check_types(frame.mapped, frame.n_mapped);
+    else
+      check_types(frame.points.data(), frame.points.size());
+    ++n_read;
+    stats::sample("points per frame", frame.size());
+    return true;
+  };
+
+  // stdout may be the output, so progress goes to stderr
+  cerr << min_x << ' ' << max_x << endl;
+  cerr << min_y << ' ' << max_y << endl;
+
+  unique_ptr<IndexedGifWriter> gif;
+  unique_ptr<RawVideoWriter> video;
+  try {
+    if (a.format == "gif") {
+      gif = make_unique<IndexedGifWriter>(a.outfile, a.width, a.height, palette(max_type), a.delay);
+    } else {
+      // the same frame rate as the gif, with the delay in hundredths of a second
+      video = make_unique<RawVideoWriter>(a.outfile, a.width, a.height, palette(max_type)
+                                          , a.format == "y4m" ? RawVideoWriter::y4m : RawVideoWriter::ppm
+                                          , a.delay > 0 ? 100 : 25, a.delay > 0 ? a.delay : 1);
+    }
+  } catch (runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
 
-  cout << endl;
+  size_t buffer_size = a.width * a.height;
+  cerr << buffer_size << endl;
+
+  // errors reading the input end the animation early, errors writing it stop
+  // rendering
+  string read_error;
+  string write_error;
+  View view{min_x, max_x, min_y, max_y, max_type, a.width, a.height};
+  vector<TileCache> caches(a.threads);
+  for (auto &c: caches)
+    c.tolerance = a.motion_tolerance;
+  bool written = render_pipeline(a.threads, buffer_size
+    , [&](Frame &frame) {
+      try {
+        return read_next(frame);
+      } catch (runtime_error &e) {
+        read_error = e.what();
+        return false;
+      }
+    }
+    , [&](const Frame &frame, vector<uint8_t> &buffer, int t) {
+      stats::Timer timer("render");
+      if (frame.mapped)
+        render_frame(frame.mapped, frame.n_mapped, buffer, caches[t], view);
+      else
+        render_frame(frame.points.data(), frame.points.size(), buffer, caches[t], view);
+    }
+    , [&](size_t k, const vector<uint8_t> &buffer) {
+      cerr << "\rRendering frame " << k * (1 + a.frameskip);
+      if (trajectory)
+        cerr << "/" << trajectory->size() - 1;
+      stats::count("frames", 1);
+      try {
+        if (gif) {
+          stats::Timer timer("gif encode");
+          gif->write_frame(buffer.data());
+        } else {
+          stats::Timer timer("video write");
+          video->write_frame(buffer.data());
+        }
+      } catch (runtime_error &e) {
+        // e.g. the disk is full or the reading end of the pipe is gone
+        write_error = e.what();
+        return false;
+      }
+      return true;
+    });
+
+  if (written) {
+    try {
+      if (gif) {
+        gif->finish();
+        stats::count("bytes written", gif->bytes());
+      } else {
+        video->finish();
+        stats::count("bytes written", video->bytes());
+      }
+    } catch (runtime_error &e) {
+      write_error = e.what();
+      written = false;
+    }
+  }
+  cerr << endl;
+  int status = 0;
+  if (!written) {
+    cerr << write_error << endl;
+    status = 1;
+  } else if (!read_error.empty()) {
+    cerr << read_error << endl;
+    status = 1;
+  }
+  if (!stats::finish(cerr)) {
+    cerr << "cannot write trace " << a.trace << endl;
+    return 1;
+  }
+  return status;
 }
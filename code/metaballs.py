@@ -78,7 +78,10 @@ def parse(line):
 @click.argument('outdir', type=str)
 def render_frames(width, height, infile, outdir):
     with open(infile, 'r') as inf:
-        for i, line in enumerate(inf):
+        # lines starting with # aren't frames (particles ends its text
+        # output with a "# bounds ..." summary line)
+        frames = (line for line in inf if not line.startswith('#'))
+        for i, line in enumerate(frames):
             cells, mutants = parse(line)
             render_frame(
                 outdir + '/frame{:09d}.png'.format(i),
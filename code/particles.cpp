@@ -1,16 +1,17 @@
-#include <algorithm>
-#include <cassert>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <memory>
+#include <limits>
 #include <random>
-#include <regex>
 #include <string>
-#include <vector>
 
 #include <tclap/CmdLine.h>
 
+#include "physics.h"
+#include "simulation.h"
+#include "stats.h"
+
 
 using namespace std;
 
@@ -18,148 +19,6 @@ using namespace std;
 const string VERSION = "0.0.0";
 
 
-struct Node {
-  Node(size_t type, double birthtime=0.0)
-    : type(type)
-    , birthtime(birthtime) { }
-
-  size_t type;
-  double birthtime;
-  shared_ptr<Node> left = nullptr;
-  shared_ptr<Node> right = nullptr;
-};
-
-std::ostream &operator<<(std::ostream &out, const std::shared_ptr<Node> n) {
-  if (n->left == nullptr && n->right == nullptr) {
-    out << static_cast<char>('A' + n->type) << ':' << n->birthtime;
-  } else {
-    out << '(' << n->left << ',' << n->right << ')' << static_cast<char>('A' + n->type) << ':' << n->birthtime;
-  }
-  return out;
-}
-
-
-size_t name_to_number(string s) {
-  assert(s.size() == 1);
-  return static_cast<size_t>(s[0] - 'A');
-}
-
-
-// TODO memory usage is terrible like this, due to excessive string replication
-// but at the moment, regex does not support string_view, and I don't want to create a workaround
-shared_ptr<Node> parse_tree(string s, double time) {
-  // cout << endl;
-  static regex re_parens(R"([\(\)])");
-  static regex re_leaf(R"(([A-Z]):(\d+\.?\d*e?-?\d*))");
-  // static regex re_branch(R"(\((.*)\)([A-Z]):(\d+\.?\d*e?-?\d*))");
-  // cout << s << endl;
-  // check if we have a leaf (recursion end condition)
-  smatch m;
-  if (!regex_search(s, m, re_parens)) {
-    // cout << "LEAF!" << endl;
-    // return a leaf node
-    regex_match(s, m, re_leaf);
-    // cout << m[1] << '\t' << m[2] << endl;
-    double dt = stod(m[2]);
-    // cout << name_to_number(m[1]) << '\t' << time + dt << endl;
-    return make_shared<Node>(name_to_number(m[1]), time + dt);
-  }
-
-  // otherwise, recursively parse further branches
-  // cout << "not leaf" << endl;
-  // cout << s.size() << endl;
-  int end = s.size() - 1;
-  while (s[end] != ')')
-    --end;
-  string ss(s, 1, end - 1);
-  string infosec(s, end + 1, s.size() - end - 1);
-  regex_match(infosec, m, re_leaf);
-  // cout << m[1] << '\t' << m[2] << endl;
-  double dt = stod(m[2]);
-  auto branch = make_shared<Node>(name_to_number(m[1]), time + dt);
-  // cout << ss << endl;
-  // cout << infosec << endl;
-
-  // now split by central comma
-  int n_paren = 0;
-  size_t i = 0;
-  while (i < ss.size()) {
-    if (ss[i] == ',' && n_paren == 0)
-      break;
-    else if (ss[i] == '(')
-      ++n_paren;
-    else if (ss[i] == ')')
-      --n_paren;
-    i++;
-  }
-  string left(ss, 0, i);
-  string right(ss, i + 1, ss.size() - i);
-  // remove outermost parenthesis if present
-  // if (left[0] == '(' && left[left.size() - 1] == ')')
-  //   left = string(left, 1, left.size() - 2);
-  // if (right[0] == '(' && right[right.size() - 1] == ')')
-  //   right = string(right, 1, right.size() - 2);
-  // unneccessary
-  // cout << left << '\t' << right << endl;
-  branch->left = parse_tree(left, time + dt);
-  branch->right = parse_tree(right, time + dt);
-  return branch;
-  // return nullptr;
-}
-
-
-vector< shared_ptr<Node> > parse_forest(const string &s) {
-  // First, split forest into trees (semicolon delimited)
-  vector< shared_ptr<Node> > forest;
-  auto it = s.begin();
-  auto itp = it;
-  do {
-    it = find(itp, s.end(), ';');
-    if (it == itp)
-      break;
-    forest.push_back(parse_tree(string(itp, it), 0.0));
-    itp = it;
-    ++itp;
-  } while (it != s.end());
-
-  return forest;
-}
-
-
-struct Point {
-  double x;
-  double y;
-  shared_ptr<Node> cell = nullptr;
-};
-struct Vector {
-  double x;
-  double y;
-};
-
-
-ostream &operator<<(ostream &out, Point p) {
-  out << static_cast<char>('A' + p.cell->type) << '(' << p.x << ", " << p.y << ')';
-  return out;
-}
-ostream &operator<<(ostream &out, Vector p) {
-  out << '(' << p.x << ", " << p.y << ')';
-  return out;
-}
-
-// Parameters for the Lennard-Jones potential
-constexpr double sigma = 0.03;
-constexpr double epsilon4 = 50.0 * 4.0;
-constexpr double sigma6 = pow(sigma, 6.0);
-
-// Potential between a and b
-double lj_potential(Point a, Point b) {
-  double r2 = (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);
-  double r6 = pow(r2, 3.0);
-  double sbyr6 = sigma6 / r6; // I wonder if reusing r2 here is faster? (avoids allocation?)
-  return epsilon4 * (sbyr6*sbyr6 - sbyr6);
-}
-
-
 Vector set_magnitude(Vector v, double m) {
   double theta;
   if (v.x == 0)
@@ -175,64 +34,10 @@ Vector set_magnitude(Vector v, double m) {
 }
 
 
-// Force on a because of potential between a and b
-Vector lj_force(Point a, Point b) {
-  // cout << a << '\t' << b << endl;
-  double r2 = (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);
-  if (r2 <= 0.0)
-    return Vector {0.01, 0.01}; // prevent particles sticking together if they land exactly on top (unlikely)
-  // cout << "dist " << r2 << endl;
-  double r6 = pow(r2, 3.0);
-  double f =  epsilon4 * 6.0 * sigma6 * (r6 - 2.0 * sigma6) / (r6 * r6 * sqrt(r2));
-  Vector q {b.x - a.x, b.y - a.y};
-  double qmag = sqrt(q.x*q.x + q.y*q.y);
-  // cout << q << '\t' << f << '\t' << qmag << endl;
-  q.x /= qmag;
-  q.y /= qmag;
-  q.x *= f;
-  q.y *= f;
-  // cout << q << endl;
-  return q;
-}
-
-
-Vector cap_velocity(Vector v, double cap) {
-  double mag = sqrt(v.x*v.x + v.y*v.y);
-  // cout << mag << endl;
-  if (mag <= cap)
-    return v;
-  // cout << 'n' << endl;
-  // double theta;
-  // if (v.x == 0)
-  //   theta = 1.571;
-  // else
-  //   theta = atan(v.y / v.x);
-  // if (v.y < 0)
-  //   theta += 3.14159;
-  Vector n;
-  n.x = v.x * cap / mag;
-  n.y = v.y * cap / mag;
-  // n.x = cos(theta) * cap;
-  // n.y = sin(theta) * cap;
-  return n;
-}
-
-
-
-struct Arguments {
-  string forest;
-  string forestfile;
-  double end_time;
-  double timestep;
-  double friction;
-  double max_velocity;
-  double max_acceleration;
-};
-
-
 int main(int argc, char **argv) {
 
   Arguments a;
+  ifstream checkpoint_in;
   try {
     TCLAP::CmdLine cmd("General treatment simulator", ' ', VERSION);
 
@@ -243,6 +48,23 @@ int main(int argc, char **argv) {
     TCLAP::ValueArg<double> a_friction("r", "friction", "Particle friction multiplier", false, 0.8, "double", cmd);
     TCLAP::ValueArg<double> a_max_velocity("v", "max-velocity", "Max particle velocity", false, 6.0, "double", cmd);
     TCLAP::ValueArg<double> a_max_acceleration("a", "max-acceleration", "Max particle acceleration", false, 3.5, "double", cmd);
+    TCLAP::ValueArg<int> a_threads("j", "threads", "Number of threads for the physics step", false, 1, "integer", cmd);
+    TCLAP::ValueArg<uint64_t> a_seed("S", "seed", "Seed for the division angles (random if not given)", false, 0, "integer", cmd);
+    TCLAP::ValueArg<string> a_format("o", "format", "Output format, text or binary (see trajectory.h)", false, "text", "text|binary", cmd);
+    TCLAP::ValueArg<int> a_output_every("e", "output-every", "Only write every nth physics step", false, 1, "integer", cmd);
+    TCLAP::ValueArg<double> a_output_interval("s", "output-interval", "Only write a frame every this much simulated time (instead of --output-every)", false, 0.0, "double", cmd);
+    TCLAP::ValueArg<double> a_cutoff("c", "cutoff", "Interaction cutoff radius (all pairs interact if not given)", false, numeric_limits<double>::infinity(), "double", cmd);
+    TCLAP::ValueArg<double> a_skin("k", "skin", "With a cutoff, keep lists of the particles within cutoff + skin and only rebuild them when a particle moved more than skin / 2 (0 finds pairs anew every step)", false, 0.0, "double", cmd);
+    TCLAP::SwitchArg a_adaptive("A", "adaptive", "Adapt the timestep: grow it up to --max-timestep while particles move little, shrink it as far as needed when they speed up. Frames are written every --output-interval (or --output-every * --timestep) of simulated time", cmd);
+    TCLAP::ValueArg<double> a_max_timestep("D", "max-timestep", "Largest adaptive timestep", false, 0.05, "double", cmd);
+    TCLAP::ValueArg<double> a_tolerance("T", "tolerance", "Furthest a particle may move in one adaptive timestep", false, 0.05 * sigma, "double", cmd);
+    TCLAP::ValueArg<string> a_precision("P", "precision", "Store positions and velocities in double, or in float for half the memory traffic (forces are still summed in double)", false, "double", "double|float", cmd);
+    TCLAP::ValueArg<string> a_outfile("O", "outfile", "Write the trajectory to this file instead of stdout", false, "", "filename", cmd);
+    TCLAP::ValueArg<string> a_checkpoint("C", "checkpoint", "Save the state of the simulation to this file every --checkpoint-interval seconds (needs --outfile)", false, "", "filename", cmd);
+    TCLAP::ValueArg<double> a_checkpoint_interval("I", "checkpoint-interval", "Wall clock seconds between checkpoints", false, 300.0, "double", cmd);
+    TCLAP::SwitchArg a_resume("R", "resume", "Continue from the --checkpoint file, with the parameters and output file of the checkpointed run (--endtime may be changed)", cmd);
+    TCLAP::SwitchArg a_stats("", "stats", "Print the time spent in each phase and other counts to stderr at the end", cmd);
+    TCLAP::ValueArg<string> a_trace("", "trace", "Write the phases as a Chrome trace event file (for chrome://tracing or ui.perfetto.dev)", false, "", "filename", cmd);
 
     cmd.parse(argc, argv);
 
@@ -253,8 +75,107 @@ int main(int argc, char **argv) {
     a.friction = a_friction.getValue();
     a.max_velocity = a_max_velocity.getValue();
     a.max_acceleration = a_max_acceleration.getValue();
+    a.cutoff = a_cutoff.getValue();
+    a.skin = a_skin.getValue();
+    a.adaptive = a_adaptive.getValue();
+    a.max_timestep = a_max_timestep.getValue();
+    a.tolerance = a_tolerance.getValue();
+    a.threads = a_threads.getValue();
+    if (a_seed.isSet()) {
+      a.seed = a_seed.getValue();
+    } else {
+      random_device rd;
+      a.seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+    a.format = a_format.getValue();
+    a.output_every = a_output_every.getValue();
+    a.output_interval = a_output_interval.getValue();
+    a.precision = a_precision.getValue();
+    a.outfile = a_outfile.getValue();
+    a.checkpoint = a_checkpoint.getValue();
+    a.checkpoint_interval = a_checkpoint_interval.getValue();
+    a.resume = a_resume.getValue();
+    a.stats = a_stats.getValue();
+    a.trace = a_trace.getValue();
+    if (!stats::enable(a.stats, a.trace))
+      cerr << "this build has no --stats or --trace (built with NO_STATS)" << endl;
+
+    if (!(a.cutoff > 0.0)) {
+      cerr << "cutoff must be positive" << endl;
+      return 1;
+    }
+    if (!(a.skin >= 0.0)) {
+      cerr << "skin can't be negative" << endl;
+      return 1;
+    }
+    if (!(a.timestep > 0.0)) {
+      cerr << "timestep must be positive" << endl;
+      return 1;
+    }
+    if (a.adaptive && !(a.max_timestep >= a.timestep && a.tolerance > 0.0)) {
+      cerr << "max timestep must be at least the timestep, and the tolerance positive" << endl;
+      return 1;
+    }
+    if (a.threads < 1) {
+      cerr << "need at least one thread" << endl;
+      return 1;
+    }
+    if (a.output_every < 1 || a.output_interval < 0.0) {
+      cerr << "output interval must be positive" << endl;
+      return 1;
+    }
+    if (a_output_every.isSet() && a_output_interval.isSet()) {
+      cerr << "use either --output-every or --output-interval, not both" << endl;
+      return 1;
+    }
+    if (a.format != "text" && a.format != "binary") {
+      cerr << "unknown output format " << a.format << endl;
+      return 1;
+    }
+    if (a.precision != "double" && a.precision != "float") {
+      cerr << "unknown precision " << a.precision << endl;
+      return 1;
+    }
+    if (!a.checkpoint.empty() && a.outfile.empty() && !a.resume) {
+      cerr << "checkpoints need the output in a file (--outfile)" << endl;
+      return 1;
+    }
+    if (a.resume && a.checkpoint.empty()) {
+      cerr << "--resume needs the --checkpoint to resume from" << endl;
+      return 1;
+    }
+    if (!(a.checkpoint_interval >= 0.0)) {
+      cerr << "checkpoint interval can't be negative" << endl;
+      return 1;
+    }
 
-    if (a.forest == "n/a" && a.forestfile == "n/a") {
+    if (a.resume) {
+      // the parameters come from the checkpoint, except for these
+      double end_time = a.end_time;
+      string outfile = a.outfile;
+      checkpoint_in.open(a.checkpoint, ios::binary);
+      char magic[4];
+      uint32_t version = 0;
+      if (!checkpoint_in.read(magic, 4) || memcmp(magic, checkpoint_magic, 4) != 0
+          || !checkpoint_in.read(reinterpret_cast<char *>(&version), sizeof(version))) {
+        cerr << a.checkpoint << " is not a checkpoint" << endl;
+        return 1;
+      }
+      if (version != checkpoint_version) {
+        cerr << "unsupported checkpoint version " << version << endl;
+        return 1;
+      }
+      try {
+        get_arguments(checkpoint_in, a);
+      } catch (runtime_error &e) {
+        cerr << e.what() << endl;
+        return 1;
+      }
+      if (a_end_time.isSet())
+        a.end_time = end_time;
+      if (a_outfile.isSet())
+        a.outfile = outfile;
+    } else if (a.forest == "n/a" && a.forestfile == "n/a") {
       // cout << "provide a forest directly or in a file via -f or -i" << endl;
       return 0;
     }
@@ -273,134 +194,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-
-  // Parse record of branching process
-  auto forest = parse_forest(a.forest);
-  // cout << endl;
-  // cout << "Resulting trees:" << endl;
-  // for (auto t: forest) cout << t << endl;
-  // exit(0);
-
-
-  // Set up starting particles
-  vector<Point> points;
-  {
-    int box_edge = ceil(sqrt(forest.size()));
-    double xx = -box_edge / 4.0;
-    double yy = -box_edge / 4.0;
-    for (size_t i = 0; i < forest.size(); ++i) {
-      points.push_back(Point{xx, yy, forest[i]});
-        xx += sigma;
-      if (xx >= box_edge / 2.0) {
-        xx = -box_edge / 4.0 + 0.5;
-        yy += sigma * 0.866;
-      }
-    }
-  }
-
-  vector<Vector> velocities;
-  for (size_t i = 0; i < forest.size(); ++i) {
-    velocities.push_back(Vector{0.0, 0.0});
-  }
-
-  double time = 0;
-
-  cout << time << ' ';
-  for (size_t i = 0; i < points.size() - 1; ++i)
-    cout << points[i] << ", ";
-  cout << points.back() << endl;
-
-  while (time < a.end_time) {
-
-    // cout << time << ' ';
-    // for (size_t i = 0; i < points.size() - 1; ++i) {
-    //   cout << points[i] << ":";
-    //   cout << velocities[i] << ", ";
-    // }
-    // cout << points.back() << ":";
-    // cout << velocities.back() << endl;
-
-    // physics simulation
-    vector<Point> old_points = points;
-    for (size_t i = 0; i < points.size(); ++i) {
-      Point &p = points[i];
-
-      // find acceleration
-      Vector acc {0.0, 0.0};
-      for (size_t j = 0; j < old_points.size(); ++j) {
-        if (i == j) continue; // Points do not interact with themselves
-        Point &p2 = old_points[j];
-        Vector f = lj_force(p, p2);
-        // cout << i << ' ' << j << '\t' << f.x << ' ' << f.y << endl;
-        // assume mass = 1
-        acc.x += f.x;
-        acc.y += f.y;
-      }
-
-      acc = cap_velocity(acc, a.max_acceleration);
-
-      // update velocity
-      Vector &v = velocities[i];
-      v.x += acc.x * a.timestep;
-      v.y += acc.y * a.timestep;
-
-      v = cap_velocity(v, a.max_velocity);
-
-      // update position
-      p.x += v.x * a.timestep + acc.x * a.timestep * a.timestep;
-      p.y += v.y * a.timestep + acc.y * a.timestep * a.timestep;
-
-      v.x *= a.friction;
-      v.y *= a.friction;
-    }
-
-    time += a.timestep;
-
-    cout << time << ' ';
-    for (size_t i = 0; i < points.size() - 1; ++i)
-      cout << points[i] << ", ";
-    cout << points.back() << endl;
-
-    random_device rd;
-    mt19937 rng(rd());
-    std::uniform_real_distribution<double> random_angle(0.0, 3.14159);
-
-    // divide/kill cells if relevant
-    for (size_t i = 0; i < points.size(); ++i) {
-      Point p = points[i];
-      if (p.cell->birthtime > time)
-        continue; // your time has note come yet young one
-
-      if (p.cell->left == nullptr && p.cell->right == nullptr) {
-        // cout << "killing" << endl;
-        // kill the cell
-        points.erase(points.begin() + i);
-        velocities.erase(velocities.begin() + i);
-        --i;
-      } else if (p.cell->left != nullptr && p.cell->right != nullptr) {
-        // cout << "dividing" << endl;
-        // kill and divide the cell
-        // cout << p.cell->left << endl;
-        // cout << p.cell->right << endl;
-        double angle = random_angle(rng);
-        double x_offset = cos(angle) * sigma * 0.00005;
-        double y_offset = sin(angle) * sigma * 0.00005;
-        // cout << p << ' ' << x_offset << ' ' << y_offset << endl;
-        points.push_back(Point{p.x + x_offset, p.y + y_offset, p.cell->left});
-        // cout << points.back() << endl;
-        points.push_back(Point{p.x - x_offset, p.y - y_offset, p.cell->right});
-        // cout << points.back() << endl;
-        velocities.push_back(Vector{0.0, 0.0});
-        velocities.push_back(Vector{0.0, 0.0});
-        // cout << "division done, killing" << endl;
-        points.erase(points.begin() + i);
-        velocities.erase(velocities.begin() + i);
-        --i;
-      } else {
-        cerr << "invalid subtree: " << p.cell << endl;
-        cout << endl;
-      }
-    }
-
+  int status = a.precision == "float" ? simulate<float>(a, checkpoint_in) : simulate<double>(a, checkpoint_in);
+  if (!stats::finish(cerr)) {
+    cerr << "cannot write trace " << a.trace << endl;
+    return 1;
   }
+  return status;
 }
@@ -0,0 +1,612 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "thread_pool.h"
+
+// The AVX2 kernels are compiled for AVX2 whatever the target of the build
+// (with a target attribute), and only used if the CPU running the program
+// has it, see have_avx2()
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PHYSICS_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+
+struct Vector {
+  double x;
+  double y;
+};
+
+
+// Parameters for the Lennard-Jones potential
+constexpr double sigma = 0.03;
+constexpr double epsilon4 = 50.0 * 4.0;
+constexpr double sigma6 = sigma*sigma*sigma*sigma*sigma*sigma;
+// magnitude of the force is lj_scale * (r^6 - 2 sigma^6) / r^13, and the
+// direction vector (dx, dy) has length r, so the components of the force are
+// lj_scale * (r^6 - 2 sigma^6) / (r^12 * r^2) * (dx, dy): no roots needed
+constexpr double lj_scale = epsilon4 * 6.0 * sigma6;
+// force returned for two particles on exactly the same spot, to prevent them
+// sticking together (unlikely)
+constexpr double lj_overlap_force = 0.01;
+
+
+// Positions may be stored in double or float (--precision in particles).
+// With float, the pair terms are computed in float, but forces are always
+// summed in double.
+
+// The Lennard-Jones force on a particle from one at (dx, dy) from it, where
+// r2 = dx^2 + dy^2 > 0, is f (dx, dy) with f = lj_factor(r2)
+inline double lj_factor(double r2) {
+  double r6 = r2*r2*r2;
+  return lj_scale * (r6 - 2.0 * sigma6) / (r6 * r6 * r2);
+}
+
+// r^14 leaves the range of float for close and for distant pairs, so in float
+// the factor is computed in units of sigma as (1 / u^4) (1 - 2 / u^3), with
+// u = r2 / sigma^2 of at least lj_min_u: pairs closer than that are pushed
+// apart far harder than the acceleration cap allows anyway
+constexpr float lj_scale_u = static_cast<float>(lj_scale / (sigma6 * sigma * sigma));
+constexpr float inverse_sigma2 = static_cast<float>(1.0 / (sigma * sigma));
+constexpr float lj_min_u = 1e-4f;
+
+inline float lj_factor(float r2) {
+  float inv = 1.0f / std::max(r2 * inverse_sigma2, lj_min_u);
+  float inv2 = inv * inv;
+  return lj_scale_u * (inv2 * inv2) * (1.0f - 2.0f * inv2 * inv);
+}
+
+
+// Sum of the Lennard-Jones forces on a particle at (ax, ay) from the particles
+// (bx[k], by[k]) for k in [0, n), skipping k == skip (pass n or more to not
+// skip anything) and particles further away than sqrt(cutoff2).
+template <typename T>
+Vector lj_accumulate_scalar(T ax, T ay, const T *bx, const T *by, size_t n, size_t skip, double cutoff2) {
+  Vector acc {0.0, 0.0};
+  for (size_t k = 0; k < n; ++k) {
+    if (k == skip)
+      continue;
+    T dx = bx[k] - ax;
+    T dy = by[k] - ay;
+    T r2 = dx*dx + dy*dy;
+    if (r2 > cutoff2)
+      continue;
+    if (r2 <= 0) {
+      acc.x += lj_overlap_force;
+      acc.y += lj_overlap_force;
+      continue;
+    }
+    T f = lj_factor(r2);
+    acc.x += dx * f;
+    acc.y += dy * f;
+  }
+  return acc;
+}
+
+
+#ifdef PHYSICS_AVX2
+inline bool have_avx2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+// AVX2 version of lj_accumulate_scalar, four pairs at a time. Each lane keeps
+// its own partial sums, so the result differs from the scalar kernel in the
+// last bits, but is the same on every call with the same input.
+AVX2_TARGET inline Vector lj_accumulate_avx2(double ax, double ay, const double *bx, const double *by
+                                 , size_t n, size_t skip, double cutoff2) {
+  const __m256d vax = _mm256_set1_pd(ax);
+  const __m256d vay = _mm256_set1_pd(ay);
+  const __m256d vcutoff2 = _mm256_set1_pd(cutoff2);
+  const __m256d vzero = _mm256_setzero_pd();
+  const __m256d vscale = _mm256_set1_pd(lj_scale);
+  const __m256d v2sigma6 = _mm256_set1_pd(2.0 * sigma6);
+  const __m256d voverlap = _mm256_set1_pd(lj_overlap_force);
+  const __m256d vone = _mm256_set1_pd(1.0);
+  const __m256i lane = _mm256_set_epi64x(3, 2, 1, 0);
+
+  __m256d accx = vzero;
+  __m256d accy = vzero;
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(bx + k), vax);
+    __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(by + k), vay);
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+
+    __m256d not_self = _mm256_castsi256_pd(
+        _mm256_xor_si256(_mm256_cmpeq_epi64(_mm256_add_epi64(lane, _mm256_set1_epi64x(k))
+                                            , _mm256_set1_epi64x(skip))
+                         , _mm256_set1_epi64x(-1)));
+    __m256d in_range = _mm256_and_pd(not_self, _mm256_cmp_pd(r2, vcutoff2, _CMP_LE_OQ));
+    __m256d apart = _mm256_cmp_pd(r2, vzero, _CMP_GT_OQ);
+    __m256d interact = _mm256_and_pd(in_range, apart);
+    __m256d overlap = _mm256_andnot_pd(apart, in_range);
+
+    // keep the division finite in lanes that are masked out anyway
+    __m256d safe_r2 = _mm256_blendv_pd(vone, r2, apart);
+    __m256d r6 = _mm256_mul_pd(_mm256_mul_pd(safe_r2, safe_r2), safe_r2);
+    __m256d f = _mm256_div_pd(_mm256_mul_pd(vscale, _mm256_sub_pd(r6, v2sigma6))
+                              , _mm256_mul_pd(_mm256_mul_pd(r6, r6), safe_r2));
+    f = _mm256_and_pd(f, interact);
+
+    __m256d push = _mm256_and_pd(voverlap, overlap);
+    accx = _mm256_add_pd(accx, _mm256_add_pd(_mm256_mul_pd(dx, f), push));
+    accy = _mm256_add_pd(accy, _mm256_add_pd(_mm256_mul_pd(dy, f), push));
+  }
+
+  alignas(32) double sx[4];
+  alignas(32) double sy[4];
+  _mm256_store_pd(sx, accx);
+  _mm256_store_pd(sy, accy);
+  Vector tail = lj_accumulate_scalar(ax, ay, bx + k, by + k, n - k, skip - k, cutoff2);
+  return Vector {((sx[0] + sx[1]) + (sx[2] + sx[3])) + tail.x
+               , ((sy[0] + sy[1]) + (sy[2] + sy[3])) + tail.y};
+}
+
+// Add the eight float lanes of v to the four double lanes of acc
+AVX2_TARGET inline __m256d add_widened(__m256d acc, __m256 v) {
+  acc = _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+  return _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// The pair terms of eight pairs in float, see lj_factor(float)
+AVX2_TARGET inline __m256 lj_factor_avx2(__m256 r2) {
+  __m256 u = _mm256_max_ps(_mm256_mul_ps(r2, _mm256_set1_ps(inverse_sigma2)), _mm256_set1_ps(lj_min_u));
+  __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), u);
+  __m256 inv2 = _mm256_mul_ps(inv, inv);
+  __m256 repulsion = _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(inv2, inv)));
+  return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(lj_scale_u), _mm256_mul_ps(inv2, inv2)), repulsion);
+}
+
+// Float version: eight pairs at a time, summed in double
+AVX2_TARGET inline Vector lj_accumulate_avx2(float ax, float ay, const float *bx, const float *by
+                                 , size_t n, size_t skip, double cutoff2) {
+  const __m256 vax = _mm256_set1_ps(ax);
+  const __m256 vay = _mm256_set1_ps(ay);
+  const __m256 vcutoff2 = _mm256_set1_ps(static_cast<float>(std::min(cutoff2, 1e38)));
+  const __m256 vzero = _mm256_setzero_ps();
+  const __m256 voverlap = _mm256_set1_ps(static_cast<float>(lj_overlap_force));
+  const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  // skip is n or more when nothing is skipped, so it can be clamped to the
+  // 32 bit lane indices
+  const __m256i vskip = _mm256_set1_epi32(static_cast<int>(std::min<size_t>(skip, INT32_MAX)));
+
+  __m256d accx = _mm256_setzero_pd();
+  __m256d accy = _mm256_setzero_pd();
+  // the last up to eight particles with a masked load rather than one at a
+  // time, as rows of the cell grid are often short
+  for (size_t k = 0; k < n; k += 8) {
+    __m256i index = _mm256_add_epi32(lane, _mm256_set1_epi32(static_cast<int>(k)));
+    __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(std::min<size_t>(n - k, 8))), lane);
+    __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(bx + k, valid), vax);
+    __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(by + k, valid), vay);
+    __m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+
+    __m256 not_self = _mm256_castsi256_ps(_mm256_andnot_si256(_mm256_cmpeq_epi32(index, vskip), valid));
+    __m256 in_range = _mm256_and_ps(not_self, _mm256_cmp_ps(r2, vcutoff2, _CMP_LE_OQ));
+    __m256 apart = _mm256_cmp_ps(r2, vzero, _CMP_GT_OQ);
+    __m256 interact = _mm256_and_ps(in_range, apart);
+    __m256 overlap = _mm256_andnot_ps(apart, in_range);
+
+    __m256 f = _mm256_and_ps(lj_factor_avx2(r2), interact);
+    __m256 push = _mm256_and_ps(voverlap, overlap);
+    accx = add_widened(accx, _mm256_add_ps(_mm256_mul_ps(dx, f), push));
+    accy = add_widened(accy, _mm256_add_ps(_mm256_mul_ps(dy, f), push));
+  }
+
+  alignas(32) double sx[4];
+  alignas(32) double sy[4];
+  _mm256_store_pd(sx, accx);
+  _mm256_store_pd(sy, accy);
+  return Vector {(sx[0] + sx[1]) + (sx[2] + sx[3]), (sy[0] + sy[1]) + (sy[2] + sy[3])};
+}
+#endif
+
+
+template <typename T>
+Vector lj_accumulate(T ax, T ay, const T *bx, const T *by, size_t n, size_t skip, double cutoff2) {
+#ifdef PHYSICS_AVX2
+  if (have_avx2())
+    return lj_accumulate_avx2(ax, ay, bx, by, n, skip, cutoff2);
+#endif
+  return lj_accumulate_scalar(ax, ay, bx, by, n, skip, cutoff2);
+}
+
+
+// Sum of the Lennard-Jones forces on a particle at (ax, ay) from the particles
+// (bx[idx[k]], by[idx[k]]) for k in [0, m) that are within sqrt(cutoff2)
+template <typename T>
+Vector lj_accumulate_indexed_scalar(T ax, T ay, const T *bx, const T *by
+                                    , const uint32_t *idx, size_t m, double cutoff2) {
+  Vector acc {0.0, 0.0};
+  for (size_t k = 0; k < m; ++k) {
+    T dx = bx[idx[k]] - ax;
+    T dy = by[idx[k]] - ay;
+    T r2 = dx*dx + dy*dy;
+    if (r2 > cutoff2)
+      continue;
+    if (r2 <= 0) {
+      acc.x += lj_overlap_force;
+      acc.y += lj_overlap_force;
+      continue;
+    }
+    T f = lj_factor(r2);
+    acc.x += dx * f;
+    acc.y += dy * f;
+  }
+  return acc;
+}
+
+
+#ifdef PHYSICS_AVX2
+// AVX2 version of lj_accumulate_indexed_scalar, gathering four neighbours at a
+// time
+AVX2_TARGET inline Vector lj_accumulate_indexed_avx2(double ax, double ay, const double *bx, const double *by
+                                         , const uint32_t *idx, size_t m, double cutoff2) {
+  const __m256d vax = _mm256_set1_pd(ax);
+  const __m256d vay = _mm256_set1_pd(ay);
+  const __m256d vcutoff2 = _mm256_set1_pd(cutoff2);
+  const __m256d vzero = _mm256_setzero_pd();
+  const __m256d vscale = _mm256_set1_pd(lj_scale);
+  const __m256d v2sigma6 = _mm256_set1_pd(2.0 * sigma6);
+  const __m256d voverlap = _mm256_set1_pd(lj_overlap_force);
+  const __m256d vone = _mm256_set1_pd(1.0);
+  const __m256d vall = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+  __m256d accx = vzero;
+  __m256d accy = vzero;
+  size_t k = 0;
+  for (; k + 4 <= m; k += 4) {
+    __m128i vidx = _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx + k));
+    // the masked gather, as the plain one trips -Wmaybe-uninitialized in GCC
+    __m256d dx = _mm256_sub_pd(_mm256_mask_i32gather_pd(vzero, bx, vidx, vall, 8), vax);
+    __m256d dy = _mm256_sub_pd(_mm256_mask_i32gather_pd(vzero, by, vidx, vall, 8), vay);
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+
+    __m256d in_range = _mm256_cmp_pd(r2, vcutoff2, _CMP_LE_OQ);
+    __m256d apart = _mm256_cmp_pd(r2, vzero, _CMP_GT_OQ);
+    __m256d interact = _mm256_and_pd(in_range, apart);
+    __m256d overlap = _mm256_andnot_pd(apart, in_range);
+
+    __m256d safe_r2 = _mm256_blendv_pd(vone, r2, apart);
+    __m256d r6 = _mm256_mul_pd(_mm256_mul_pd(safe_r2, safe_r2), safe_r2);
+    __m256d f = _mm256_div_pd(_mm256_mul_pd(vscale, _mm256_sub_pd(r6, v2sigma6))
+                              , _mm256_mul_pd(_mm256_mul_pd(r6, r6), safe_r2));
+    f = _mm256_and_pd(f, interact);
+
+    __m256d push = _mm256_and_pd(voverlap, overlap);
+    accx = _mm256_add_pd(accx, _mm256_add_pd(_mm256_mul_pd(dx, f), push));
+    accy = _mm256_add_pd(accy, _mm256_add_pd(_mm256_mul_pd(dy, f), push));
+  }
+
+  alignas(32) double sx[4];
+  alignas(32) double sy[4];
+  _mm256_store_pd(sx, accx);
+  _mm256_store_pd(sy, accy);
+  Vector tail = lj_accumulate_indexed_scalar(ax, ay, bx, by, idx + k, m - k, cutoff2);
+  return Vector {((sx[0] + sx[1]) + (sx[2] + sx[3])) + tail.x
+               , ((sy[0] + sy[1]) + (sy[2] + sy[3])) + tail.y};
+}
+
+// Float version, gathering eight neighbours at a time
+AVX2_TARGET inline Vector lj_accumulate_indexed_avx2(float ax, float ay, const float *bx, const float *by
+                                         , const uint32_t *idx, size_t m, double cutoff2) {
+  const __m256 vax = _mm256_set1_ps(ax);
+  const __m256 vay = _mm256_set1_ps(ay);
+  const __m256 vcutoff2 = _mm256_set1_ps(static_cast<float>(std::min(cutoff2, 1e38)));
+  const __m256 vzero = _mm256_setzero_ps();
+  const __m256 voverlap = _mm256_set1_ps(static_cast<float>(lj_overlap_force));
+  const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+  __m256d accx = _mm256_setzero_pd();
+  __m256d accy = _mm256_setzero_pd();
+  // the last up to eight neighbours with a masked gather
+  for (size_t k = 0; k < m; k += 8) {
+    __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(std::min<size_t>(m - k, 8))), lane);
+    __m256i vidx = _mm256_maskload_epi32(reinterpret_cast<const int *>(idx + k), valid);
+    __m256 dx = _mm256_sub_ps(_mm256_mask_i32gather_ps(vzero, bx, vidx, _mm256_castsi256_ps(valid), 4), vax);
+    __m256 dy = _mm256_sub_ps(_mm256_mask_i32gather_ps(vzero, by, vidx, _mm256_castsi256_ps(valid), 4), vay);
+    __m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+
+    __m256 in_range = _mm256_and_ps(_mm256_castsi256_ps(valid), _mm256_cmp_ps(r2, vcutoff2, _CMP_LE_OQ));
+    __m256 apart = _mm256_cmp_ps(r2, vzero, _CMP_GT_OQ);
+    __m256 interact = _mm256_and_ps(in_range, apart);
+    __m256 overlap = _mm256_andnot_ps(apart, in_range);
+
+    __m256 f = _mm256_and_ps(lj_factor_avx2(r2), interact);
+    __m256 push = _mm256_and_ps(voverlap, overlap);
+    accx = add_widened(accx, _mm256_add_ps(_mm256_mul_ps(dx, f), push));
+    accy = add_widened(accy, _mm256_add_ps(_mm256_mul_ps(dy, f), push));
+  }
+
+  alignas(32) double sx[4];
+  alignas(32) double sy[4];
+  _mm256_store_pd(sx, accx);
+  _mm256_store_pd(sy, accy);
+  return Vector {(sx[0] + sx[1]) + (sx[2] + sx[3]), (sy[0] + sy[1]) + (sy[2] + sy[3])};
+}
+#endif
+
+
+template <typename T>
+Vector lj_accumulate_indexed(T ax, T ay, const T *bx, const T *by
+                             , const uint32_t *idx, size_t m, double cutoff2) {
+#ifdef PHYSICS_AVX2
+  if (have_avx2())
+    return lj_accumulate_indexed_avx2(ax, ay, bx, by, idx, m, cutoff2);
+#endif
+  return lj_accumulate_indexed_scalar(ax, ay, bx, by, idx, m, cutoff2);
+}
+
+
+// Scale (x, y) down to magnitude cap if it is longer than that. Written
+// without branches so that loops over many particles vectorize.
+inline void cap_magnitude(double &x, double &y, double cap) {
+  double mag = std::sqrt(x*x + y*y);
+  bool over = mag > cap;
+  x = over ? x * cap / mag : x;
+  y = over ? y * cap / mag : y;
+}
+
+
+// Move particles [begin, end) on by a step of length dt, with accelerations
+// (ax, ay) capped to max_acceleration and the new velocities capped to
+// max_velocity. Velocities are multiplied by friction after the move. The
+// update is in double, whatever the positions are stored in.
+// The build turns off contraction into fused multiply-adds, so the result
+// doesn't depend on where this is inlined or on the target's instructions.
+template <typename T>
+void advance(T *x, T *y, T *vx, T *vy, const double *ax, const double *ay
+             , size_t begin, size_t end, double dt, double friction
+             , double max_acceleration, double max_velocity) {
+  for (size_t i = begin; i < end; ++i) {
+    double accx = ax[i];
+    double accy = ay[i];
+    cap_magnitude(accx, accy, max_acceleration);
+
+    // update velocity
+    double vxi = vx[i] + accx * dt;
+    double vyi = vy[i] + accy * dt;
+    cap_magnitude(vxi, vyi, max_velocity);
+
+    // update position
+    x[i] += vxi * dt + accx * dt * dt;
+    y[i] += vyi * dt + accy * dt * dt;
+
+    vx[i] = vxi * friction;
+    vy[i] = vyi * friction;
+  }
+}
+
+
+// Uniform bucket grid over a snapshot of the particle positions, used to
+// restrict the force calculation to pairs closer than the cutoff.
+// Particles are counting-sorted by cell, keeping their original order within
+// a cell, and copied into x/y so that the particles of a row of cells are
+// contiguous: cells c .. c + 2 of a row cover x[start[c]] .. x[start[c + 3] - 1].
+// With an infinite cutoff there is a single cell, i.e. all pairs interact.
+// T is the type of the positions.
+template <typename T>
+struct CellGrid {
+  double x0;
+  double y0;
+  double size;
+  int nx;
+  int ny;
+  std::vector<size_t> start;
+  std::vector<size_t> cell_of;  // cell of original particle i
+  std::vector<size_t> slot_of;  // position of original particle i in x/y
+  std::vector<size_t> original; // original particle at position s in x/y
+  std::vector<T> x;
+  std::vector<T> y;
+
+  int column(double px) const {
+    return std::min(std::max(static_cast<int>((px - x0) / size), 0), nx - 1);
+  }
+  int row(double py) const {
+    return std::min(std::max(static_cast<int>((py - y0) / size), 0), ny - 1);
+  }
+
+  void build(const T *px, const T *py, size_t n, double cutoff) {
+    double x1 = std::numeric_limits<double>::lowest();
+    double y1 = std::numeric_limits<double>::lowest();
+    x0 = std::numeric_limits<double>::max();
+    y0 = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < n; ++i) {
+      x0 = std::min(x0, static_cast<double>(px[i]));
+      x1 = std::max(x1, static_cast<double>(px[i]));
+      y0 = std::min(y0, static_cast<double>(py[i]));
+      y1 = std::max(y1, static_cast<double>(py[i]));
+    }
+    if (n == 0)
+      x0 = x1 = y0 = y1 = 0.0;
+
+    if (std::isfinite(cutoff)) {
+      // cells must be at least as large as the cutoff, but don't make many
+      // more cells than there are particles (a small cutoff on a sparse
+      // system would otherwise allocate an enormous, mostly empty grid)
+      size = cutoff;
+      double max_cells = 4.0 * n + 16.0;
+      while (((x1 - x0) / size + 1.0) * ((y1 - y0) / size + 1.0) > max_cells)
+        size *= 2.0;
+      nx = static_cast<int>((x1 - x0) / size) + 1;
+      ny = static_cast<int>((y1 - y0) / size) + 1;
+    } else {
+      size = std::numeric_limits<double>::infinity();
+      nx = 1;
+      ny = 1;
+    }
+
+    start.assign(nx*ny + 1, 0);
+    cell_of.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      cell_of[i] = nx == 1 && ny == 1 ? 0 : row(py[i])*nx + column(px[i]);
+      ++start[cell_of[i] + 1];
+    }
+    for (size_t c = 0; c < static_cast<size_t>(nx*ny); ++c)
+      start[c + 1] += start[c];
+
+    slot_of.resize(n);
+    original.resize(n);
+    x.resize(n);
+    y.resize(n);
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+      size_t s = fill[cell_of[i]]++;
+      slot_of[i] = s;
+      original[s] = i;
+      x[s] = px[i];
+      y[s] = py[i];
+    }
+  }
+
+  // Total force on original particle i from all other particles within the cutoff
+  Vector force(size_t i, double cutoff2) const {
+    int cx = cell_of[i] % nx;
+    int cy = cell_of[i] / nx;
+    size_t self = slot_of[i];
+    T ax = x[self];
+    T ay = y[self];
+    int x_lo = std::max(cx - 1, 0);
+    int x_hi = std::min(cx + 1, nx - 1);
+    Vector acc {0.0, 0.0};
+    for (int r = std::max(cy - 1, 0); r <= std::min(cy + 1, ny - 1); ++r) {
+      size_t begin = start[r*nx + x_lo];
+      size_t end = start[r*nx + x_hi + 1];
+      Vector f = lj_accumulate(ax, ay, x.data() + begin, y.data() + begin
+                               , end - begin, self - begin, cutoff2);
+      acc.x += f.x;
+      acc.y += f.y;
+    }
+    return acc;
+  }
+
+  // Number of other particles force(i) looks at
+  size_t pairs(size_t i) const {
+    int cx = cell_of[i] % nx;
+    int cy = cell_of[i] / nx;
+    int x_lo = std::max(cx - 1, 0);
+    int x_hi = std::min(cx + 1, nx - 1);
+    size_t n = 0;
+    for (int r = std::max(cy - 1, 0); r <= std::min(cy + 1, ny - 1); ++r)
+      n += start[r*nx + x_hi + 1] - start[r*nx + x_lo];
+    return n - 1;
+  }
+};
+
+
+
+// Verlet neighbour lists: for every particle, the particles that were within
+// cutoff + skin of it when the lists were built. As long as no particle has
+// moved more than skin / 2 since, every pair closer than the cutoff is in the
+// lists. They have to be built again after that, or when particles are added
+// or removed.
+template <typename T>
+struct NeighbourLists {
+  std::vector<size_t> start;     // neighbours of i are index[start[i]] .. index[start[i + 1] - 1]
+  std::vector<uint32_t> index;
+  std::vector<T> x0;             // positions when the lists were built
+  std::vector<T> y0;
+  double skin = 0.0;
+  std::vector< std::vector<uint32_t> > blocks;
+
+  size_t size() const { return x0.size(); }
+
+  void build(const T *px, const T *py, size_t n, double cutoff, double skin
+             , CellGrid<T> &grid, ThreadPool &pool) {
+    this->skin = skin;
+    double reach = cutoff + skin;
+    double reach2 = reach * reach;
+    grid.build(px, py, n, reach);
+    x0.assign(px, px + n);
+    y0.assign(py, py + n);
+
+    // the neighbours of blocks of particles are found in parallel into
+    // separate lists, and then concatenated
+    size_t n_blocks = std::min(n, pool.size() * 8);
+    blocks.resize(n_blocks);
+    start.resize(n + 1);
+    start[0] = 0;
+    pool.parallel_for(n_blocks, [&](size_t block_begin, size_t block_end) {
+      for (size_t b = block_begin; b < block_end; ++b) {
+        std::vector<uint32_t> &found = blocks[b];
+        size_t kept = 0;
+        for (size_t i = n * b / n_blocks; i < n * (b + 1) / n_blocks; ++i) {
+          int cx = grid.cell_of[i] % grid.nx;
+          int cy = grid.cell_of[i] / grid.nx;
+          size_t self = grid.slot_of[i];
+          int x_lo = std::max(cx - 1, 0);
+          int x_hi = std::min(cx + 1, grid.nx - 1);
+          for (int r = std::max(cy - 1, 0); r <= std::min(cy + 1, grid.ny - 1); ++r) {
+            // every candidate is stored and only kept if it is in reach,
+            // which avoids a hard to predict branch per pair
+            size_t s_begin = grid.start[r*grid.nx + x_lo];
+            size_t s_end = grid.start[r*grid.nx + x_hi + 1];
+            found.resize(kept + (s_end - s_begin));
+            for (size_t s = s_begin; s < s_end; ++s) {
+              T dx = grid.x[s] - px[i];
+              T dy = grid.y[s] - py[i];
+              found[kept] = grid.original[s];
+              kept += (s != self) & (dx*dx + dy*dy <= reach2);
+            }
+          }
+          start[i + 1] = kept;
+        }
+      }
+    });
+    // start is relative to its block so far
+    size_t total = 0;
+    for (size_t b = 0; b < n_blocks; ++b) {
+      size_t first = n * b / n_blocks;
+      size_t last = n * (b + 1) / n_blocks;
+      size_t block_size = start[last];
+      for (size_t i = first; i < last; ++i)
+        start[i + 1] += total;
+      total += block_size;
+    }
+    index.resize(total);
+    pool.parallel_for(n_blocks, [&](size_t block_begin, size_t block_end) {
+      for (size_t b = block_begin; b < block_end; ++b) {
+        size_t first = n * b / n_blocks;
+        size_t last = n * (b + 1) / n_blocks;
+        std::copy_n(blocks[b].begin(), start[last] - start[first], index.begin() + start[first]);
+      }
+    });
+  }
+
+  // Make the lists stale, e.g. after particles were added or removed
+  void invalidate() {
+    x0.clear();
+    y0.clear();
+  }
+
+  // Whether some particle moved too far since the lists were built
+  bool stale(const T *px, const T *py, size_t n) const {
+    if (n != size())
+      return true;
+    double limit2 = skin * skin / 4.0;
+    bool moved = false;
+    for (size_t i = 0; i < n; ++i) {
+      double dx = static_cast<double>(px[i]) - x0[i];
+      double dy = static_cast<double>(py[i]) - y0[i];
+      moved |= dx*dx + dy*dy > limit2;
+    }
+    return moved;
+  }
+
+  // Total force on particle i from its neighbours within the cutoff
+  Vector force(size_t i, const T *px, const T *py, double cutoff2) const {
+    return lj_accumulate_indexed(px[i], py[i], px, py, index.data() + start[i]
+                                 , start[i + 1] - start[i], cutoff2);
+  }
+};
+
+#endif
@@ -1,13 +1,16 @@
 #include <fstream>
 #include <iostream>
 #include <limits>
-#include <regex>
+#include <memory>
 #include <vector>
 #include <string>
 
 #include <SDL2/SDL.h>
 #include <tclap/CmdLine.h>
 
+#include "stats.h"
+#include "trajectory.h"
+
 
 using namespace std;
 
@@ -37,34 +40,20 @@ struct Frame {
 };
 
 vector<Frame> parse_input(string filename) {
-  fstream f;
-  f.open(filename, fstream::in);
-  string s;
-  regex re_time(R"((\d+.?\d*e?-?\d*))");
-  regex re_point(R"(([A-Z])\((-?\d+.?\d*e?-?\d*), (-?\d+.?\d*e?-?\d*)\))");
+  ifstream f(filename);
+  TextTrajectoryReader in(f);
   vector<Frame> frames;
-  while (getline(f, s)) {
-    Frame frame;
-    cout << s << '\n';
-    smatch m;
-    regex_search(s, m, re_time);
-    frame.time = stod(m[1]);
-    cout << frame.time << '\n';
-    while (regex_search(s, m, re_point)) {
-      for (auto p: m) {
-        cout << p << ' ';
-      } cout << '\n';
-      size_t type = static_cast<size_t>(string(m[1])[0] - 'A');
-      double x = stod(m[2]);
-      double y = stod(m[3]);
-      min_x = min(min_x, x);
-      max_x = max(max_x, x);
-      min_y = min(min_y, y);
-      max_y = max(max_y, y);
-      frame.points.push_back(Point{x, y, type});
-      s = m.suffix().str();
-    }
+  Frame frame;
+  auto add_point = [&](double x, double y, unsigned type) {
+    min_x = min(min_x, x);
+    max_x = max(max_x, x);
+    min_y = min(min_y, y);
+    max_y = max(max_y, y);
+    frame.points.push_back(Point{x, y, type});
+  };
+  while (in.next(frame.time, add_point)) {
     frames.push_back(frame);
+    frame.points.clear();
   }
 
   double wx = (max_x - min_x) / 20.0;
@@ -97,26 +86,76 @@ vector<Frame> parse_input(string filename) {
 
 struct Arguments {
   string filename;
+  bool stats;
+  string trace;
 };
 
 
+template <typename P>
+void draw_points(SDL_Renderer *renderer, const P *points, size_t n) {
+  double xw = (max_x - min_x);
+  double yw = (max_y - min_y);
+  for (size_t i = 0; i < n; ++i) {
+    const P &point = points[i];
+    switch (point.type) {
+    case 0:
+      SDL_SetRenderDrawColor(renderer, 0xAA, 0xAA, 0x3A, 0xFF);
+      break;
+    case 1:
+      SDL_SetRenderDrawColor(renderer, 0xAA, 0x3A, 0xAA, 0xFF);
+    }
+    SDL_RenderDrawPoint(renderer, (point.x - min_x) / xw * WIDTH, (point.y - min_y) / yw * HEIGHT);
+  }
+}
+
+
 int main(int argc, char **argv) {
   Arguments a;
   try {
     TCLAP::CmdLine cmd("General treatment simulator", ' ', VERSION);
 
     TCLAP::ValueArg<string> a_file("i", "forestfile", "Forest of cell growth", true, "n/a", "; separated trees", cmd);
+    TCLAP::SwitchArg a_stats("", "stats", "Print the time spent in each phase and other counts to stderr at the end", cmd);
+    TCLAP::ValueArg<string> a_trace("", "trace", "Write the phases as a Chrome trace event file (for chrome://tracing or ui.perfetto.dev)", false, "", "filename", cmd);
 
     cmd.parse(argc, argv);
 
     a.filename = a_file.getValue();
+    a.stats = a_stats.getValue();
+    a.trace = a_trace.getValue();
+    if (!stats::enable(a.stats, a.trace))
+      cerr << "this build has no --stats or --trace (built with NO_STATS)" << endl;
 
   } catch (TCLAP::ArgException &e) {
     cerr << "TCLAP Error: " << e.error() << endl << "\targ: " << e.argId() << endl;
     return 1;
   }
 
-  auto frames = parse_input(a.filename);
+  // binary trajectories are used in place through a memory map, text ones are parsed
+  vector<Frame> frames;
+  unique_ptr<MappedTrajectory> trajectory;
+  try {
+    stats::Timer timer("parse");
+    if (is_binary_trajectory(a.filename)) {
+      trajectory = make_unique<MappedTrajectory>(a.filename);
+      min_x = trajectory->min_x;
+      max_x = trajectory->max_x;
+      min_y = trajectory->min_y;
+      max_y = trajectory->max_y;
+      double wx = (max_x - min_x) / 20.0;
+      double wy = (max_y - min_y) / 20.0;
+      min_x -= wx;
+      max_x += wx;
+      min_y -= wy;
+      max_y += wy;
+    } else {
+      frames = parse_input(a.filename);
+    }
+  } catch (runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  size_t n_frames = trajectory ? trajectory->size() : frames.size();
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
     SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
@@ -140,24 +179,21 @@ int main(int argc, char **argv) {
 
  BEGIN_FRAMES:
 
-  for (auto frame: frames) {
-    SDL_SetRenderDrawColor(renderer, 0x6, 0x18, 0x20, 0xFF);
-    SDL_RenderClear(renderer);
-
-    for (auto point: frame.points) {
-      double xw = (max_x - min_x);
-      double yw = (max_y - min_y);
-      switch (point.type) {
-      case 0:
-        SDL_SetRenderDrawColor(renderer, 0xAA, 0xAA, 0x3A, 0xFF);
-        break;
-      case 1:
-        SDL_SetRenderDrawColor(renderer, 0xAA, 0x3A, 0xAA, 0xFF);
-      }
-      SDL_RenderDrawPoint(renderer, (point.x - min_x) / xw * WIDTH, (point.y - min_y) / yw * HEIGHT);
-    }
+  for (size_t i = 0; i < n_frames; ++i) {
+    {
+      stats::Timer timer("render");
+      SDL_SetRenderDrawColor(renderer, 0x6, 0x18, 0x20, 0xFF);
+      SDL_RenderClear(renderer);
 
-    SDL_RenderPresent(renderer);
+      if (trajectory)
+        draw_points(renderer, trajectory->points(i), trajectory->count(i));
+      else
+        draw_points(renderer, frames[i].points.data(), frames[i].points.size());
+
+      SDL_RenderPresent(renderer);
+    }
+    stats::count("frames", 1);
+    stats::count("points drawn", trajectory ? trajectory->count(i) : frames[i].points.size());
 
     while (SDL_PollEvent(&event) != 0) {
       if (event.type == SDL_QUIT) {
@@ -194,4 +230,9 @@ int main(int argc, char **argv) {
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
+
+  if (!stats::finish(cerr)) {
+    cerr << "cannot write trace " << a.trace << endl;
+    return 1;
+  }
 }
@@ -0,0 +1,129 @@
+#ifndef RAW_VIDEO_H
+#define RAW_VIDEO_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Writer for uncompressed video streams of frames given as palette indices,
+// to pipe into a video encoder, e.g.
+//   metaballs -F y4m -o - ... | ffmpeg -i - out.mp4
+// y4m is YUV4MPEG2 with full resolution (4:4:4) chroma, ppm is a sequence of
+// binary PPM images (ffmpeg -f image2pipe -c:v ppm -i -). A filename of "-"
+// writes to stdout.
+class RawVideoWriter {
+public:
+  typedef std::array<uint8_t, 3> Colour;
+  enum Format { y4m, ppm };
+
+  // frame_rate_num / frame_rate_den frames per second (only written for y4m)
+  RawVideoWriter(const std::string &filename, int width, int height
+                 , const std::vector<Colour> &palette, Format format
+                 , int frame_rate_num, int frame_rate_den)
+    : width(width)
+    , height(height)
+    , format(format) {
+    if (filename == "-") {
+      f = stdout;
+    } else {
+      f = std::fopen(filename.c_str(), "wb");
+      if (f == nullptr)
+        throw std::runtime_error("cannot open " + filename);
+    }
+    // a whole frame goes out with a single write, so there is no need for a
+    // buffer (setvbuf has to come before anything else on the stream)
+    std::setvbuf(f, nullptr, _IONBF, 0);
+
+    std::string header;
+    if (format == y4m) {
+      // the palette as limited range BT.601 YCbCr
+      for (const Colour &c: palette) {
+        double r = c[0];
+        double g = c[1];
+        double b = c[2];
+        table.push_back({
+            static_cast<uint8_t>(std::lround(16.0 + (65.481*r + 128.553*g + 24.966*b) / 255.0))
+          , static_cast<uint8_t>(std::lround(128.0 + (-37.797*r - 74.203*g + 112.0*b) / 255.0))
+          , static_cast<uint8_t>(std::lround(128.0 + (112.0*r - 93.786*g - 18.214*b) / 255.0))});
+      }
+      header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height)
+               + " F" + std::to_string(frame_rate_num) + ":" + std::to_string(frame_rate_den)
+               + " Ip A1:1 C444\n";
+      std::fwrite(header.data(), 1, header.size(), f);
+      written += header.size();
+      frame_header = "FRAME\n";
+    } else {
+      table = palette;
+      frame_header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    }
+
+    size_t n = static_cast<size_t>(width) * height;
+    frame.resize(frame_header.size() + 3*n);
+    std::copy(frame_header.begin(), frame_header.end(), frame.begin());
+  }
+
+  ~RawVideoWriter() {
+    if (f != nullptr)
+      finish();
+  }
+
+  RawVideoWriter(const RawVideoWriter &) = delete;
+  RawVideoWriter &operator=(const RawVideoWriter &) = delete;
+
+  // Append a frame of width * height palette indices, row by row
+  void write_frame(const uint8_t *pixels) {
+    size_t n = static_cast<size_t>(width) * height;
+    uint8_t *out = frame.data() + frame_header.size();
+    if (format == y4m) {
+      // planar: all Y, then all Cb, then all Cr
+      for (size_t i = 0; i < n; ++i) {
+        const Colour &c = table[pixels[i]];
+        out[i] = c[0];
+        out[n + i] = c[1];
+        out[2*n + i] = c[2];
+      }
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        const Colour &c = table[pixels[i]];
+        out[3*i] = c[0];
+        out[3*i + 1] = c[1];
+        out[3*i + 2] = c[2];
+      }
+    }
+    if (std::fwrite(frame.data(), 1, frame.size(), f) != frame.size())
+      throw std::runtime_error("error writing video frame");
+    written += frame.size();
+  }
+
+  // Bytes written so far
+  uint64_t bytes() const {
+    return written;
+  }
+
+  void finish() {
+    if (f != stdout)
+      std::fclose(f);
+    else
+      std::fflush(f);
+    f = nullptr;
+  }
+
+private:
+  std::FILE *f = nullptr;
+  uint64_t written = 0;
+  int width;
+  int height;
+  Format format;
+  std::vector<Colour> table;  // palette index to output pixel
+  std::string frame_header;
+  std::vector<uint8_t> frame;
+};
+
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Rendering of cells as metaballs into pictures of palette indices, see
+// metaballs.cpp
+
+struct Point {
+  double x;
+  double y;
+  size_t type;
+};
+
+// The part of the plane shown in a picture of width x height pixels, and the
+// largest cell type in it
+struct View {
+  double min_x;
+  double max_x;
+  double min_y;
+  double max_y;
+  size_t max_type;
+  int width;
+  int height;
+};
+
+
+inline double cfield(double r) {
+  if (r < 0.0001) {
+    return 1.0 - r;
+  } else {
+    return 0.0;
+    // return max(0.0, 1.0 - (r-0.0001)*2000);
+  }
+  // return (r < 0.0002 ? 1.0 : 0.0);
+}
+inline double tfield(double r) {
+  if (r < 0.0001) {
+    return 1.0;
+  } else {
+    return std::max(0.0, 1.0 - (r-0.0001)*30.0);
+  }
+}
+template <typename P>
+double distance2(const Point &a, const P &b) {
+  return (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);
+}
+template <typename P>
+double distance(const Point &a, const P &b) {
+  return std::sqrt(distance2(a, b));
+}
+
+// cfield (of squared distance) and tfield (of distance) are exactly zero for
+// cells further from a pixel than this. The slack makes sure rounding never
+// lets a cell that is left out contribute to a pixel.
+constexpr double field_support = (0.0001 + 1.0 / 30.0) * 1.000001;
+constexpr int tile_size = 16;
+
+
+// Bucket grid over the points of a frame, so that a tile of pixels only has
+// to look at the cells that can reach it. Points are counting sorted by bin
+// and keep their original order within a bin.
+struct PointBins {
+  double x0;
+  double y0;
+  double size;
+  int nx;
+  int ny;
+  std::vector<size_t> start;
+  std::vector<size_t> order;
+
+  template <typename P>
+  void build(const P *points, size_t n, double x1, double y1) {
+    // bins at least as large as the support, but not many more than points
+    size = field_support;
+    double max_bins = 4.0 * n + 16.0;
+    while (((x1 - x0) / size + 1.0) * ((y1 - y0) / size + 1.0) > max_bins)
+      size *= 2.0;
+    nx = static_cast<int>((x1 - x0) / size) + 1;
+    ny = static_cast<int>((y1 - y0) / size) + 1;
+
+    std::vector<size_t> bin_of(n);
+    start.assign(nx*ny + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+      bin_of[i] = row(points[i].y)*nx + column(points[i].x);
+      ++start[bin_of[i] + 1];
+    }
+    for (int b = 0; b < nx*ny; ++b)
+      start[b + 1] += start[b];
+    order.resize(n);
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; ++i)
+      order[fill[bin_of[i]]++] = i;
+  }
+
+  int column(double x) const {
+    return std::min(std::max(static_cast<int>(std::floor((x - x0) / size)), 0), nx - 1);
+  }
+  int row(double y) const {
+    return std::min(std::max(static_cast<int>(std::floor((y - y0) / size)), 0), ny - 1);
+  }
+};
+
+
+typedef std::array<uint8_t, 3> Colour;
+
+// Colours of cells by type (repeating if there are more types than colours)
+const std::vector<Colour> cell_colours {
+  {85, 0, 255},
+  {255, 127, 0},
+  {0, 160, 80},
+  {220, 20, 60},
+  {0, 150, 200},
+  {200, 0, 200},
+  {150, 100, 0},
+  {40, 40, 40},
+};
+
+// Frames are rendered as indices into a palette of the background, the halo
+// around cells and then the cell colours
+constexpr uint8_t background_index = 0;
+constexpr uint8_t halo_index = 1;
+constexpr uint8_t first_cell_index = 2;
+
+inline std::vector<Colour> palette(size_t max_type) {
+  std::vector<Colour> p {{255, 255, 255}, {127, 127, 127}};
+  for (size_t t = 0; t <= max_type && t < cell_colours.size(); ++t)
+    p.push_back(cell_colours[t]);
+  return p;
+}
+
+
+// Colour the pixels [x0, x1) x [y0, y1) from the nearby cells. With K cell
+// types the per type field sums are fixed size arrays on the stack; K = 0
+// handles any number of types (max_type + 1) with the sums on the heap.
+template <int K>
+void shade_tile(const std::vector<Point> &near, int x0, int y0, int x1, int y1
+                , std::vector<uint8_t> &buffer, const View &v) {
+  const size_t n_types = K > 0 ? K : v.max_type + 1;
+  double f_fixed[K > 0 ? K : 1];
+  double f2_fixed[K > 0 ? K : 1];
+  std::vector<double> f_dynamic(K > 0 ? 0 : n_types);
+  std::vector<double> f2_dynamic(K > 0 ? 0 : n_types);
+  double *f = K > 0 ? f_fixed : f_dynamic.data();
+  double *f2 = K > 0 ? f2_fixed : f2_dynamic.data();
+
+  double xw = (v.max_x - v.min_x);
+  double yw = (v.max_y - v.min_y);
+
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      std::fill(f, f + n_types, 0.0);
+      std::fill(f2, f2 + n_types, 0.0);
+      Point here{
+            v.min_x + static_cast<double>(x) / static_cast<double>(v.width) * xw
+          , v.min_y + static_cast<double>(y) / static_cast<double>(v.height) * yw
+          , 0
+          };
+      for (auto &p: near) {
+        f[p.type] += cfield(distance2(here, p));
+        f2[p.type] += tfield(distance(here, p));
+      }
+      double total_f = 0.0;
+      double total_f2 = 0.0;
+      for (size_t t = 0; t < n_types; ++t) {
+        total_f += f[t];
+        total_f2 += f2[t];
+      }
+
+      uint8_t c;
+      if (total_f > 0.5) {
+        // the most common type, the first one in case of ties
+        size_t main_type = 0;
+        for (size_t t = 1; t < n_types; ++t) {
+          if (f[t] > f[main_type])
+            main_type = t;
+        }
+        c = first_cell_index + main_type % cell_colours.size();
+      } else if (total_f2 > 0.5) {
+        c = halo_index;
+      } else {
+        c = background_index;
+      }
+      buffer[y*v.width + x] = c;
+    }
+  }
+}
+
+typedef void (*ShadeTile)(const std::vector<Point> &, int, int, int, int, std::vector<uint8_t> &, const View &);
+
+inline ShadeTile shade_tile_for(size_t n_types) {
+  switch (n_types) {
+  case 1: return shade_tile<1>;
+  case 2: return shade_tile<2>;
+  case 3: return shade_tile<3>;
+  case 4: return shade_tile<4>;
+  case 5: return shade_tile<5>;
+  case 6: return shade_tile<6>;
+  case 7: return shade_tile<7>;
+  case 8: return shade_tile<8>;
+  default: return shade_tile<0>;
+  }
+}
+
+
+// The last frame rendered by a thread, with the cells that each tile was
+// rendered from. A tile whose cells are the same in the next frame has the
+// same pixels, so they can be copied instead of rendered again. Cells that
+// moved less than tolerance count as the same.
+struct TileCache {
+  std::vector< std::vector<Point> > near;
+  std::vector<uint8_t> pixels;
+  double tolerance = 0.0;
+};
+
+// Whether a tile rendered from the cells `before` still looks right for the
+// cells `now`: the same cells, none moved further than tolerance
+inline bool same_cells(const std::vector<Point> &now, const std::vector<Point> &before, double tolerance) {
+  if (now.size() != before.size())
+    return false;
+  for (size_t k = 0; k < now.size(); ++k) {
+    if (now[k].type != before[k].type)
+      return false;
+    if (tolerance == 0.0 ? now[k].x != before[k].x || now[k].y != before[k].y
+                         : distance2(now[k], before[k]) > tolerance * tolerance)
+      return false;
+  }
+  return true;
+}
+
+
+// Render the n points into the buffer of palette indices, reusing the tiles
+// of the previous frame in cache that don't need to be rendered again
+template <typename P>
+void render_frame(const P *points, size_t n, std::vector<uint8_t> &buffer, TileCache &cache, const View &v) {
+  double xw = (v.max_x - v.min_x);
+  double yw = (v.max_y - v.min_y);
+
+  PointBins bins;
+  bins.x0 = v.min_x;
+  bins.y0 = v.min_y;
+  bins.build(points, n, v.max_x, v.max_y);
+
+  ShadeTile shade = shade_tile_for(v.max_type + 1);
+  int tiles_x = (v.width + tile_size - 1) / tile_size;
+  int tiles_y = (v.height + tile_size - 1) / tile_size;
+  bool have_cache = !cache.pixels.empty();
+  cache.near.resize(tiles_x * tiles_y);
+  std::vector<size_t> candidates;
+  std::vector<Point> near;
+  for (int ty = 0; ty < v.height; ty += tile_size) {
+    for (int tx = 0; tx < v.width; tx += tile_size) {
+      std::vector<Point> &cached = cache.near[(ty / tile_size) * tiles_x + tx / tile_size];
+      int x_end = std::min(tx + tile_size, v.width);
+      int y_end = std::min(ty + tile_size, v.height);
+
+      // world space rectangle covered by the pixels of the tile
+      double wx0 = v.min_x + static_cast<double>(tx) / static_cast<double>(v.width) * xw;
+      double wx1 = v.min_x + static_cast<double>(x_end - 1) / static_cast<double>(v.width) * xw;
+      double wy0 = v.min_y + static_cast<double>(ty) / static_cast<double>(v.height) * yw;
+      double wy1 = v.min_y + static_cast<double>(y_end - 1) / static_cast<double>(v.height) * yw;
+
+      // cells within reach of the rectangle, in their original order so that
+      // the field sums come out exactly as when summing over every cell
+      candidates.clear();
+      for (int by = bins.row(wy0 - field_support); by <= bins.row(wy1 + field_support); ++by) {
+        for (int bx = bins.column(wx0 - field_support); bx <= bins.column(wx1 + field_support); ++bx) {
+          int b = by*bins.nx + bx;
+          for (size_t k = bins.start[b]; k < bins.start[b + 1]; ++k) {
+            const P &p = points[bins.order[k]];
+            double dx = std::max(std::max(wx0 - p.x, p.x - wx1), 0.0);
+            double dy = std::max(std::max(wy0 - p.y, p.y - wy1), 0.0);
+            if (dx*dx + dy*dy <= field_support*field_support)
+              candidates.push_back(bins.order[k]);
+          }
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+      near.clear();
+      for (size_t k: candidates)
+        near.push_back(Point{points[k].x, points[k].y, points[k].type});
+
+      if (have_cache && same_cells(near, cached, cache.tolerance)) {
+        for (int y = ty; y < y_end; ++y)
+          std::copy(cache.pixels.begin() + y*v.width + tx, cache.pixels.begin() + y*v.width + x_end
+                    , buffer.begin() + y*v.width + tx);
+      } else {
+        shade(near, tx, ty, x_end, y_end, buffer, v);
+        std::swap(near, cached);
+      }
+    }
+  }
+  cache.pixels = buffer;
+}
+
+
+#endif
@@ -0,0 +1,626 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "forest.h"
+#include "physics.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "trajectory.h"
+
+
+// The particle simulation of particles.cpp, run by simulate() with the
+// parameters in Arguments. In a header so that bench runs the same code.
+
+// Particle state as a structure of arrays: particle i is at (x[i], y[i]),
+// moves with velocity (vx[i], vy[i]) and is the cell forest[cell[i]].
+// slot[n] is the particle index of node n, while that cell is alive.
+// Positions and velocities are stored as T, double or float.
+template <typename T>
+struct Particles {
+  explicit Particles(size_t n_nodes)
+    : slot(n_nodes, no_node) { }
+
+  std::vector<T> x;
+  std::vector<T> y;
+  std::vector<T> vx;
+  std::vector<T> vy;
+  std::vector<uint32_t> cell;
+  std::vector<uint32_t> slot;
+
+  size_t size() const { return x.size(); }
+
+  void push_back(double px, double py, uint32_t c) {
+    slot[c] = x.size();
+    x.push_back(px);
+    y.push_back(py);
+    vx.push_back(0.0);
+    vy.push_back(0.0);
+    cell.push_back(c);
+  }
+
+  // Put cell c at rest at particle index i, replacing what was there
+  void replace(size_t i, double px, double py, uint32_t c) {
+    slot[cell[i]] = no_node;
+    slot[c] = i;
+    x[i] = px;
+    y[i] = py;
+    vx[i] = 0.0;
+    vy[i] = 0.0;
+    cell[i] = c;
+  }
+
+  // Remove particle i in constant time by moving the last particle into its place
+  void remove(size_t i) {
+    slot[cell[i]] = no_node;
+    size_t last = size() - 1;
+    if (i != last) {
+      x[i] = x[last];
+      y[i] = y[last];
+      vx[i] = vx[last];
+      vy[i] = vy[last];
+      cell[i] = cell[last];
+      slot[cell[i]] = i;
+    }
+    x.pop_back();
+    y.pop_back();
+    vx.pop_back();
+    vy.pop_back();
+    cell.pop_back();
+  }
+};
+
+
+// Divisions and deaths ordered by time, earliest first. Each live cell has
+// one event, at its birthtime. Ties are broken by node index, so the
+// processing order is deterministic.
+typedef std::pair<double, uint32_t> Event;
+typedef std::priority_queue< Event, std::vector<Event>, std::greater<Event> > EventQueue;
+
+
+template <typename T>
+void write_frame(TextTrajectoryWriter &out, double time, const Particles<T> &particles, const Forest &forest) {
+  out.begin_frame(time);
+  for (size_t i = 0; i < particles.size(); ++i)
+    out.point(particles.x[i], particles.y[i], forest[particles.cell[i]].type);
+}
+
+template <typename T>
+void write_frame(TrajectoryWriter &out, double time, const Particles<T> &particles, const Forest &forest) {
+  out.begin_frame(time, particles.size());
+  for (size_t i = 0; i < particles.size(); ++i)
+    out.point(particles.x[i], particles.y[i], forest[particles.cell[i]].type);
+}
+
+
+
+// Random angle in [0, pi) for the division of node, from a counter-based
+// generator (splitmix64 of the seed and the node index): every division
+// draws the same angle however the events are ordered or the work is split
+inline double division_angle(uint64_t seed, uint32_t node) {
+  uint64_t z = seed + (static_cast<uint64_t>(node) + 1) * 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z = z ^ (z >> 31);
+  // the top 53 bits as a double in [0, 1)
+  return static_cast<double>(z >> 11) * 0x1.0p-53 * 3.14159;
+}
+
+
+// Largest timestep, up to max_step, in which a particle with speed v and
+// acceleration acc moves at most distance: with the velocity updated first,
+// it moves (v + acc dt) dt + acc dt^2
+inline double step_for_distance(double v, double acc, double distance, double max_step) {
+  double dt;
+  if (acc > 0.0)
+    dt = (std::sqrt(v*v + 8.0 * acc * distance) - v) / (4.0 * acc);
+  else if (v > 0.0)
+    dt = distance / v;
+  else
+    dt = max_step;
+  return std::min(dt, max_step);
+}
+
+
+struct Arguments {
+  std::string forest;
+  std::string forestfile;
+  double end_time;
+  double timestep;
+  double friction;
+  double max_velocity;
+  double max_acceleration;
+  double cutoff;
+  double skin;
+  bool adaptive;
+  double max_timestep;
+  double tolerance;
+  int threads;
+  uint64_t seed;
+  std::string format;
+  int output_every;
+  double output_interval;
+  std::string precision;
+  std::string outfile;
+  std::string checkpoint;
+  double checkpoint_interval;
+  bool resume;
+  bool stats;
+  std::string trace;
+};
+
+
+// Checkpoints are raw copies of the simulation state, to be read back by the
+// same build of particles on the same machine: the parameters, the forest,
+// the loop state, the particles and neighbour lists, and where the output
+// had got to.
+const char checkpoint_magic[4] = {'P', 'C', 'K', 'P'};
+constexpr uint32_t checkpoint_version = 3;
+
+template<typename T>
+void put(std::ostream &out, const T &v) {
+  out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template<typename T>
+void put(std::ostream &out, const std::vector<T> &v) {
+  put(out, static_cast<uint64_t>(v.size()));
+  out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+inline void put(std::ostream &out, const std::string &s) {
+  put(out, static_cast<uint64_t>(s.size()));
+  out.write(s.data(), s.size());
+}
+
+template<typename T>
+void get(std::istream &in, T &v) {
+  if (!in.read(reinterpret_cast<char *>(&v), sizeof(T)))
+    throw std::runtime_error("checkpoint is truncated");
+}
+
+template<typename T>
+void get(std::istream &in, std::vector<T> &v) {
+  uint64_t n;
+  get(in, n);
+  if (n > (uint64_t(1) << 40) / sizeof(T))
+    throw std::runtime_error("checkpoint is corrupt");
+  v.resize(n);
+  if (!in.read(reinterpret_cast<char *>(v.data()), n * sizeof(T)))
+    throw std::runtime_error("checkpoint is truncated");
+}
+
+inline void get(std::istream &in, std::string &s) {
+  std::vector<char> v;
+  get(in, v);
+  s.assign(v.begin(), v.end());
+}
+
+// The parameters that determine the simulation and its output
+inline void put_arguments(std::ostream &out, const Arguments &a) {
+  put(out, a.end_time);
+  put(out, a.timestep);
+  put(out, a.friction);
+  put(out, a.max_velocity);
+  put(out, a.max_acceleration);
+  put(out, a.cutoff);
+  put(out, a.skin);
+  put(out, a.adaptive);
+  put(out, a.max_timestep);
+  put(out, a.tolerance);
+  put(out, a.seed);
+  put(out, a.format);
+  put(out, a.output_every);
+  put(out, a.output_interval);
+  put(out, a.precision);
+  put(out, a.outfile);
+}
+
+inline void get_arguments(std::istream &in, Arguments &a) {
+  get(in, a.end_time);
+  get(in, a.timestep);
+  get(in, a.friction);
+  get(in, a.max_velocity);
+  get(in, a.max_acceleration);
+  get(in, a.cutoff);
+  get(in, a.skin);
+  get(in, a.adaptive);
+  get(in, a.max_timestep);
+  get(in, a.tolerance);
+  get(in, a.seed);
+  get(in, a.format);
+  get(in, a.output_every);
+  get(in, a.output_interval);
+  get(in, a.precision);
+  get(in, a.outfile);
+}
+
+
+// Run the simulation set up by the arguments, or the one in checkpoint_in
+// after its header and arguments if resuming, with positions of type T
+template <typename T>
+int simulate(const Arguments &a, std::istream &checkpoint_in) {
+
+  // Parse record of branching process
+  Forest forest;
+  try {
+    stats::Timer timer("parse");
+    if (a.resume) {
+      get(checkpoint_in, forest.nodes);
+      get(checkpoint_in, forest.roots);
+    } else {
+      forest = parse_forest(a.forest);
+    }
+  } catch (std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  // cout << endl;
+  // cout << "Resulting trees:" << endl;
+  // for (auto t: forest) cout << t << endl;
+  // exit(0);
+
+
+  // Set up starting particles
+  Particles<T> particles(forest.nodes.size());
+  EventQueue events;
+  if (!a.resume) {
+    int box_edge = std::ceil(std::sqrt(forest.roots.size()));
+    double xx = -box_edge / 4.0;
+    double yy = -box_edge / 4.0;
+    for (size_t i = 0; i < forest.roots.size(); ++i) {
+      particles.push_back(xx, yy, forest.roots[i]);
+      events.push(Event{forest[forest.roots[i]].birthtime, forest.roots[i]});
+        xx += sigma;
+      if (xx >= box_edge / 2.0) {
+        xx = -box_edge / 4.0 + 0.5;
+        yy += sigma * 0.866;
+      }
+    }
+  }
+
+  double cutoff2 = a.cutoff * a.cutoff;
+  // with a cutoff and a skin, pairs come from neighbour lists that are kept
+  // over several steps, otherwise from a grid built every step
+  bool use_lists = std::isfinite(a.cutoff) && a.skin > 0.0;
+  NeighbourLists<T> lists;
+  size_t n_rebuilds = 0;
+  size_t n_neighbours = 0;
+  CellGrid<T> grid;
+  ThreadPool pool(a.threads);
+  std::vector<double> ax;
+  std::vector<double> ay;
+
+  std::ofstream outfile;
+  std::ostream &out = a.outfile.empty() ? std::cout : outfile;
+  std::unique_ptr<TrajectoryWriter> binary_out;
+  std::unique_ptr<TextTrajectoryWriter> text_out;
+  auto output = [&](double time) {
+    stats::Timer timer("output");
+    if (binary_out)
+      write_frame(*binary_out, time, particles, forest);
+    else
+      write_frame(*text_out, time, particles, forest);
+  };
+
+  double time = 0;
+  // frames are only written every output_every steps, or at the first step
+  // reaching each multiple of output_interval, physics runs at every step.
+  // Adaptive steps end exactly at each multiple of output_interval instead.
+  size_t step = 0;
+  size_t n_outputs = 1;
+  double dt = a.timestep;
+  double step_size = a.timestep;
+  // the adaptive step doubles after the limit has allowed it this many steps
+  // in a row
+  const int grow_after = 4;
+  int steps_to_grow = grow_after;
+  double output_interval = a.output_interval > 0.0 ? a.output_interval : a.output_every * a.timestep;
+
+  auto save_checkpoint = [&]() {
+    // written next to the last checkpoint and then renamed over it, so that
+    // being killed while writing leaves the last checkpoint intact
+    std::string temporary = a.checkpoint + ".tmp";
+    std::ofstream f(temporary, std::ios::binary | std::ios::trunc);
+    f.write(checkpoint_magic, 4);
+    put(f, checkpoint_version);
+    put_arguments(f, a);
+    put(f, forest.nodes);
+    put(f, forest.roots);
+    put(f, time);
+    put(f, step);
+    put(f, n_outputs);
+    put(f, dt);
+    put(f, step_size);
+    put(f, steps_to_grow);
+    put(f, particles.x);
+    put(f, particles.y);
+    put(f, particles.vx);
+    put(f, particles.vy);
+    put(f, particles.cell);
+    put(f, lists.start);
+    put(f, lists.index);
+    put(f, lists.x0);
+    put(f, lists.y0);
+    put(f, lists.skin);
+    put(f, n_rebuilds);
+    put(f, n_neighbours);
+    // the output up to here is kept on resuming, and what comes after it
+    // is replaced
+    std::ostringstream writer;
+    if (binary_out)
+      binary_out->save(writer);
+    else
+      text_out->save(writer);
+    out.flush();
+    put(f, static_cast<uint64_t>(out.tellp()));
+    put(f, writer.str());
+    f.close();
+    if (!f || !out || std::rename(temporary.c_str(), a.checkpoint.c_str()) != 0)
+      throw std::runtime_error("cannot write checkpoint " + a.checkpoint);
+  };
+
+  try {
+    if (a.resume) {
+      get(checkpoint_in, time);
+      get(checkpoint_in, step);
+      get(checkpoint_in, n_outputs);
+      get(checkpoint_in, dt);
+      get(checkpoint_in, step_size);
+      get(checkpoint_in, steps_to_grow);
+      get(checkpoint_in, particles.x);
+      get(checkpoint_in, particles.y);
+      get(checkpoint_in, particles.vx);
+      get(checkpoint_in, particles.vy);
+      get(checkpoint_in, particles.cell);
+      get(checkpoint_in, lists.start);
+      get(checkpoint_in, lists.index);
+      get(checkpoint_in, lists.x0);
+      get(checkpoint_in, lists.y0);
+      get(checkpoint_in, lists.skin);
+      get(checkpoint_in, n_rebuilds);
+      get(checkpoint_in, n_neighbours);
+      uint64_t output_size;
+      std::string writer;
+      get(checkpoint_in, output_size);
+      get(checkpoint_in, writer);
+      // every live cell has its event pending
+      for (size_t i = 0; i < particles.size(); ++i) {
+        particles.slot[particles.cell[i]] = i;
+        events.push(Event{forest[particles.cell[i]].birthtime, particles.cell[i]});
+      }
+      std::filesystem::resize_file(a.outfile, output_size);
+      outfile.open(a.outfile, std::ios::binary | std::ios::app);
+      std::istringstream state(writer);
+      if (a.format == "binary")
+        binary_out = std::make_unique<TrajectoryWriter>(out, state);
+      else
+        text_out = std::make_unique<TextTrajectoryWriter>(out, state);
+    } else {
+      if (!a.outfile.empty())
+        outfile.open(a.outfile, std::ios::binary | std::ios::trunc);
+      if (a.format == "binary")
+        binary_out = std::make_unique<TrajectoryWriter>(out);
+      else
+        text_out = std::make_unique<TextTrajectoryWriter>(out);
+    }
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (!out) {
+    std::cerr << "cannot open " << a.outfile << std::endl;
+    return 1;
+  }
+
+  using clock = std::chrono::steady_clock;
+  auto last_checkpoint = clock::now();
+
+  if (!a.resume)
+    output(time);
+
+  while (time < a.end_time) {
+
+    // physics simulation
+    // forces are computed from the positions at the start of the step, before
+    // any particle moves, and every particle only writes its own state, so
+    // the update is independent of how it is split over threads
+    size_t n = particles.size();
+    const T *px = particles.x.data();
+    const T *py = particles.y.data();
+    stats::sample("live particles", n);
+    {
+      stats::Timer timer("pair search");
+      if (use_lists) {
+        if (lists.stale(px, py, n)) {
+          lists.build(px, py, n, a.cutoff, a.skin, grid, pool);
+          ++n_rebuilds;
+          n_neighbours += lists.index.size();
+        }
+      } else {
+        grid.build(px, py, n, a.cutoff);
+      }
+    }
+    {
+      stats::Timer timer("force");
+      ax.resize(n);
+      ay.resize(n);
+      pool.parallel_for(n, [&](size_t begin, size_t end) {
+        // find acceleration (assume mass = 1)
+        for (size_t i = begin; i < end; ++i) {
+          Vector f = use_lists ? lists.force(i, px, py, cutoff2) : grid.force(i, cutoff2);
+          ax[i] = f.x;
+          ay[i] = f.y;
+        }
+      });
+    }
+    if (stats::active()) {
+      size_t pairs = 0;
+      if (use_lists) {
+        pairs = lists.index.size();
+      } else {
+        for (size_t i = 0; i < n; ++i)
+          pairs += grid.pairs(i);
+      }
+      stats::count("pair interactions", pairs);
+    }
+
+    stats::Timer integration_timer("integration");
+    if (a.adaptive) {
+      double max_force2 = 0.0;
+      double max_v2 = 0.0;
+      for (size_t i = 0; i < n; ++i) {
+        max_force2 = std::max(max_force2, ax[i]*ax[i] + ay[i]*ay[i]);
+        double vx = particles.vx[i];
+        double vy = particles.vy[i];
+        max_v2 = std::max(max_v2, vx*vx + vy*vy);
+      }
+      double acc = std::min(std::sqrt(max_force2), a.max_acceleration);
+      double limit = step_for_distance(std::sqrt(max_v2), acc, a.tolerance, a.max_timestep);
+      // the step is the timestep times a power of two, so that it changes
+      // rarely: a change of step shows as a jerk in the otherwise smooth
+      // motion. It shrinks at once as far as the limit needs (the forces of
+      // new daughters are already in the limit, capped as advance caps them),
+      // but only grows once the limit has stayed above the doubled step for
+      // a few steps, so a limit wavering around it doesn't flip the step.
+      if (limit < step_size) {
+        while (step_size > a.timestep && step_size > limit)
+          step_size /= 2.0;
+        steps_to_grow = grow_after;
+      } else if (2.0 * step_size <= limit) {
+        if (--steps_to_grow == 0) {
+          step_size *= 2.0;
+          steps_to_grow = grow_after;
+        }
+      } else {
+        steps_to_grow = grow_after;
+      }
+      dt = step_size;
+      // don't step further past the next event than a fixed step would, and
+      // split the time to the next frame into equal steps, as a short last
+      // step before each frame would show as a jerk in the animation
+      if (!events.empty())
+        dt = std::min(dt, std::max(events.top().first - time, a.timestep));
+      double to_output = n_outputs * output_interval - time;
+      dt = to_output / std::ceil(to_output / dt * (1.0 - 1e-9));
+    }
+    // friction is per --timestep
+    double friction = a.adaptive ? std::pow(a.friction, dt / a.timestep) : a.friction;
+
+    pool.parallel_for(n, [&](size_t begin, size_t end) {
+      advance(particles.x.data(), particles.y.data(), particles.vx.data(), particles.vy.data()
+              , ax.data(), ay.data(), begin, end, dt, friction, a.max_acceleration, a.max_velocity);
+    });
+
+    time += dt;
+    ++step;
+    integration_timer.stop();
+
+    if (a.adaptive) {
+      // the equal steps may add up to a hair less than the interval
+      if (time >= (n_outputs - 1e-9) * output_interval) {
+        time = n_outputs * output_interval;
+        output(time);
+        ++n_outputs;
+      }
+    } else if (a.output_interval > 0.0) {
+      // half a step of slack so rounding in time doesn't postpone a frame by a step
+      if (time + 0.5 * a.timestep >= n_outputs * a.output_interval) {
+        output(time);
+        n_outputs = static_cast<size_t>((time + 0.5 * a.timestep) / a.output_interval) + 1;
+      }
+    } else if (step % a.output_every == 0) {
+      output(time);
+    }
+
+    // divide/kill cells if relevant
+    stats::Timer events_timer("events");
+    while (!events.empty() && events.top().first <= time) {
+      uint32_t node = events.top().second;
+      events.pop();
+      stats::count("events", 1);
+      lists.invalidate();
+      const Node &cell = forest[node];
+      size_t i = particles.slot[node];
+
+      if (cell.leaf()) {
+        // kill the cell
+        particles.remove(i);
+      } else {
+        // kill and divide the cell, the left daughter takes its place
+        double angle = division_angle(a.seed, node);
+        double x_offset = std::cos(angle) * sigma * 0.00005;
+        double y_offset = std::sin(angle) * sigma * 0.00005;
+        // in float that is less than the spacing of floats from a few hundred
+        // sigma out, where both daughters would round to the same spot, so
+        // the offset grows to the spacing there (never in double)
+        T far = std::max(std::abs(particles.x[i]), std::abs(particles.y[i]));
+        double spacing = std::nextafter(far, std::numeric_limits<T>::infinity()) - far;
+        double scale = std::max(1.0, spacing / (sigma * 0.00005));
+        x_offset *= scale;
+        y_offset *= scale;
+        double px = particles.x[i];
+        double py = particles.y[i];
+        particles.replace(i, px + x_offset, py + y_offset, cell.left);
+        particles.push_back(px - x_offset, py - y_offset, cell.right);
+        events.push(Event{forest[cell.left].birthtime, cell.left});
+        events.push(Event{forest[cell.right].birthtime, cell.right});
+      }
+    }
+    events_timer.stop();
+
+    if (!a.checkpoint.empty()
+        && clock::now() - last_checkpoint >= std::chrono::duration<double>(a.checkpoint_interval)) {
+      try {
+        stats::Timer timer("checkpoint");
+        save_checkpoint();
+      } catch (std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+      }
+      last_checkpoint = clock::now();
+    }
+  }
+
+  {
+    stats::Timer timer("output");
+    if (binary_out) {
+      binary_out->finish();
+      stats::count("bytes written", binary_out->bytes());
+    } else {
+      text_out->finish();
+      stats::count("bytes written", text_out->bytes());
+    }
+  }
+  stats::count("steps", step);
+
+  if (a.adaptive && step > 0) {
+    std::cerr << step << " adaptive steps, on average " << time / step << " long ("
+              << time / step / a.timestep << " timesteps)" << std::endl;
+  }
+  if (use_lists && step > 0) {
+    std::cerr << "neighbour lists built " << n_rebuilds << " times in " << step << " steps (every "
+              << static_cast<double>(step) / n_rebuilds << " steps), "
+              << static_cast<double>(n_neighbours) / n_rebuilds << " neighbours per build" << std::endl;
+  }
+  return 0;
+}
+
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+
+// Lightweight instrumentation: scoped timers for the phases of a program,
+// counters, and sampled values (e.g. particles per step). At the end they are
+// reported as a summary table (--stats), and/or as a Chrome trace event file
+// (--trace, for chrome://tracing or ui.perfetto.dev). Nothing is recorded
+// unless stats::enable() was called, which costs one branch per timer, and
+// building with -DNO_STATS (cmake -DSTATS=OFF) compiles all of it out.
+namespace stats {
+
+#ifdef NO_STATS
+constexpr bool compiled_in = false;
+#else
+constexpr bool compiled_in = true;
+#endif
+
+using clock = std::chrono::steady_clock;
+
+// trace events beyond this many are dropped, so that long runs can't fill
+// the memory
+constexpr size_t max_trace_events = 1 << 20;
+
+struct TimerTotal {
+  uint64_t calls = 0;
+  double seconds = 0.0;
+};
+
+struct SampleTotal {
+  uint64_t samples = 0;
+  double sum = 0.0;
+  double max = 0.0;
+};
+
+struct TraceEvent {
+  const char *name;
+  char phase;      // 'X' for a timer, 'C' for a sample
+  uint32_t thread;
+  int64_t start;   // microseconds since enable()
+  int64_t duration;
+  double value;
+};
+
+struct State {
+  bool active = false;
+  bool summary = false;
+  std::string trace_file;
+  clock::time_point start;
+  std::mutex mutex;
+  std::map<std::string, TimerTotal> timers;
+  std::map<std::string, double> counters;
+  std::map<std::string, SampleTotal> samples;
+  std::vector<TraceEvent> trace;
+  size_t dropped = 0;
+  uint32_t n_threads = 0;
+};
+
+inline State state;
+
+// Small thread numbers for the trace, in order of first use
+inline uint32_t thread_number() {
+  thread_local uint32_t number = [] {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.n_threads++;
+  }();
+  return number;
+}
+
+inline int64_t microseconds(clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(t - state.start).count();
+}
+
+inline void add_trace_event(const TraceEvent &e) {
+  if (state.trace_file.empty())
+    return;
+  if (state.trace.size() < max_trace_events)
+    state.trace.push_back(e);
+  else
+    ++state.dropped;
+}
+
+
+// Start recording, for a summary and/or a trace written to trace_file (if
+// not empty) by finish(). False if asked for either in a build without them.
+inline bool enable(bool summary, const std::string &trace_file) {
+  if (!summary && trace_file.empty())
+    return true;
+  if (!compiled_in)
+    return false;
+  state.active = true;
+  state.summary = summary;
+  state.trace_file = trace_file;
+  state.start = clock::now();
+  return true;
+}
+
+inline bool active() {
+  return compiled_in && state.active;
+}
+
+
+// Times the scope it lives in, or up to stop(), as the phase name (a string
+// literal)
+class Timer {
+public:
+  explicit Timer(const char *name)
+    : name(name)
+    , running(active()) {
+    if (running)
+      start = clock::now();
+  }
+
+  ~Timer() {
+    stop();
+  }
+
+  void stop() {
+    if (!running || !active())
+      return;
+    running = false;
+    clock::time_point end = clock::now();
+    uint32_t thread = thread_number();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    TimerTotal &t = state.timers[name];
+    ++t.calls;
+    t.seconds += std::chrono::duration<double>(end - start).count();
+    add_trace_event(TraceEvent{name, 'X', thread, microseconds(start), microseconds(end) - microseconds(start), 0.0});
+  }
+
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+private:
+  const char *name;
+  bool running;
+  clock::time_point start;
+};
+
+
+// Add amount to the counter name (a string literal)
+inline void count(const char *name, double amount) {
+  if (!active())
+    return;
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.counters[name] += amount;
+}
+
+// Record a value of the quantity name (a string literal), of which the mean
+// and maximum are reported, and which shows as a graph in the trace
+inline void sample(const char *name, double value) {
+  if (!active())
+    return;
+  int64_t now = microseconds(clock::now());
+  std::lock_guard<std::mutex> lock(state.mutex);
+  SampleTotal &s = state.samples[name];
+  ++s.samples;
+  s.sum += value;
+  s.max = std::max(s.max, value);
+  add_trace_event(TraceEvent{name, 'C', 0, now, 0, value});
+}
+
+
+// Largest resident set size of the process so far, in bytes
+inline double peak_rss() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss * 1024.0; // kilobytes on Linux
+}
+
+inline void report(std::ostream &out) {
+  double run = std::chrono::duration<double>(clock::now() - state.start).count();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  out << std::fixed;
+  out << std::left << std::setw(28) << "phase" << std::right << std::setw(12) << "calls"
+      << std::setw(12) << "total s" << std::setw(12) << "mean ms" << std::setw(10) << "% of run" << std::endl;
+  for (auto &t: state.timers) {
+    out << std::left << std::setw(28) << t.first << std::right << std::setw(12) << t.second.calls
+        << std::setw(12) << std::setprecision(3) << t.second.seconds
+        << std::setw(12) << std::setprecision(4) << 1e3 * t.second.seconds / t.second.calls
+        << std::setw(10) << std::setprecision(1) << 100.0 * t.second.seconds / run << std::endl;
+  }
+  out << std::left << std::setw(28) << "run" << std::right << std::setw(24) << std::setprecision(3) << run << std::endl;
+  if (!state.counters.empty()) {
+    out << std::endl << std::left << std::setw(28) << "counter" << std::right << std::setw(16) << "total" << std::endl;
+    for (auto &c: state.counters) {
+      out << std::left << std::setw(28) << c.first << std::right << std::setw(16) << std::setprecision(0)
+          << c.second << std::endl;
+    }
+  }
+  if (!state.samples.empty()) {
+    out << std::endl << std::left << std::setw(28) << "sampled" << std::right << std::setw(12) << "samples"
+        << std::setw(14) << "mean" << std::setw(14) << "max" << std::endl;
+    for (auto &s: state.samples) {
+      out << std::left << std::setw(28) << s.first << std::right << std::setw(12) << s.second.samples
+          << std::setw(14) << std::setprecision(1) << s.second.sum / s.second.samples
+          << std::setw(14) << s.second.max << std::endl;
+    }
+  }
+  out << std::endl << std::left << std::setw(28) << "peak RSS MB" << std::right << std::setw(16)
+      << std::setprecision(1) << peak_rss() / 1e6 << std::endl;
+  out << std::defaultfloat;
+}
+
+inline bool write_trace(const std::string &filename) {
+  std::ofstream out(filename);
+  std::lock_guard<std::mutex> lock(state.mutex);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (size_t i = 0; i < state.trace.size(); ++i) {
+    const TraceEvent &e = state.trace[i];
+    out << (i > 0 ? ",\n" : "\n") << "{\"name\": \"" << e.name << "\", \"ph\": \"" << e.phase
+        << "\", \"pid\": 1, \"tid\": " << e.thread << ", \"ts\": " << e.start;
+    if (e.phase == 'X')
+      out << ", \"dur\": " << e.duration << "}";
+    else
+      out << ", \"args\": {\"value\": " << e.value << "}}";
+  }
+  out << "\n]}\n";
+  return static_cast<bool>(out);
+}
+
+// Write the summary to out and the trace file, as enabled. False if the
+// trace can't be written.
+inline bool finish(std::ostream &out) {
+  if (!active())
+    return true;
+  if (state.summary)
+    report(out);
+  bool ok = true;
+  if (!state.trace_file.empty()) {
+    ok = write_trace(state.trace_file);
+    if (state.dropped > 0)
+      out << state.dropped << " trace events dropped beyond the first " << max_trace_events << std::endl;
+  }
+  state.active = false;
+  return ok;
+}
+
+}
+
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Persistent pool of worker threads for data parallel loops.
+// parallel_for splits [0, n) into contiguous chunks that are handed out
+// dynamically to the workers and the calling thread, and returns when all
+// chunks are done. Which thread runs a chunk is arbitrary, so the loop body
+// must only write to data owned by its own indices.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t n_threads) {
+    for (size_t i = 1; i < n_threads; ++i)
+      workers.emplace_back([this]() { work(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &t: workers)
+      t.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return workers.size() + 1; }
+
+  void parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn) {
+    if (workers.empty() || n < 2) {
+      if (n > 0)
+        fn(0, n);
+      return;
+    }
+
+    // a few chunks per thread evens out uneven per-index work
+    size_t n_chunks = std::min(n, size() * 4);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &fn;
+      job_size = n;
+      job_chunks = n_chunks;
+      next_chunk = 0;
+      busy = workers.size();
+      ++generation;
+    }
+    wake.notify_all();
+
+    run_chunks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return busy == 0; });
+    job = nullptr;
+  }
+
+private:
+  void run_chunks() {
+    size_t c;
+    while ((c = next_chunk++) < job_chunks) {
+      size_t begin = job_size * c / job_chunks;
+      size_t end = job_size * (c + 1) / job_chunks;
+      (*job)(begin, end);
+    }
+  }
+
+  void work() {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this, seen]() { return stop || generation != seen; });
+        if (stop)
+          return;
+        seen = generation;
+      }
+      run_chunks();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --busy;
+      }
+      done.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  bool stop = false;
+  size_t generation = 0;
+  size_t busy = 0;
+
+  const std::function<void(size_t, size_t)> *job = nullptr;
+  size_t job_size = 0;
+  size_t job_chunks = 0;
+  std::atomic<size_t> next_chunk {0};
+};
+
+
+#endif
@@ -0,0 +1,627 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Binary trajectory format (all values little endian, as written by the host)
+//
+//   header     "VSPT", uint32 version, uint32 point record size, uint32 0
+//   frames     double time, uint32 number of points, followed by that many
+//              TrajectoryPoint records
+//   end        double 0, uint32 trajectory_end (since version 2)
+//   index      uint64 file offset of every frame
+//   footer     TrajectoryFooter
+//
+// Every record is a multiple of four bytes long, so the point records of a
+// memory mapped file can be used in place. The index and footer are written
+// last so that a trajectory can be written to a pipe, and the end marker lets
+// a reader of a pipe (TrajectoryReader) stop before them. A file without
+// footer (e.g. from an interrupted run) can still be read by walking the
+// frames.
+
+constexpr char trajectory_magic[4] = {'V', 'S', 'P', 'T'};
+constexpr uint32_t trajectory_version = 2;
+constexpr uint32_t trajectory_end = std::numeric_limits<uint32_t>::max();
+
+struct TrajectoryPoint {
+  float x;
+  float y;
+  uint16_t type;
+  uint16_t reserved;
+};
+static_assert(sizeof(TrajectoryPoint) == 12, "trajectory point records must be packed");
+
+struct TrajectoryFooter {
+  uint64_t index_offset;
+  uint64_t n_frames;
+  double min_x;
+  double max_x;
+  double min_y;
+  double max_y;
+  uint32_t max_type;
+  char magic[4];
+};
+static_assert(sizeof(TrajectoryFooter) == 56, "trajectory footer must be packed");
+
+constexpr size_t trajectory_header_size = 16;
+constexpr size_t trajectory_frame_header_size = 12;
+
+
+// Bounds of the points of a trajectory
+struct TrajectoryBounds {
+  double min_x = std::numeric_limits<double>::max();
+  double max_x = std::numeric_limits<double>::lowest();
+  double min_y = std::numeric_limits<double>::max();
+  double max_y = std::numeric_limits<double>::lowest();
+  uint32_t max_type = 0;
+
+  void add(double x, double y, uint32_t type) {
+    min_x = std::min(min_x, x);
+    max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+    max_type = std::max(max_type, type);
+  }
+};
+
+
+// Check whether filename starts like a binary trajectory
+inline bool is_binary_trajectory(const std::string &filename) {
+  std::ifstream f(filename, std::ios::binary);
+  char magic[4];
+  return f.read(magic, 4) && std::memcmp(magic, trajectory_magic, 4) == 0;
+}
+
+
+// Writes a binary trajectory to a stream, one frame at a time:
+//   begin_frame(time, n), then point(x, y, type) n times, ... , finish()
+class TrajectoryWriter {
+public:
+  explicit TrajectoryWriter(std::ostream &out)
+    : out(out)
+    , buffer(1 << 20) {
+    uint32_t header[3] = {trajectory_version, sizeof(TrajectoryPoint), 0};
+    put(trajectory_magic, 4);
+    put(header, sizeof(header));
+  }
+
+  // Continue the trajectory of a writer saved with save(), with out
+  // positioned where that writer had got to
+  TrajectoryWriter(std::ostream &out, std::istream &state)
+    : out(out)
+    , buffer(1 << 20) {
+    uint64_t n_frames = 0;
+    state.read(reinterpret_cast<char *>(&offset), sizeof(offset));
+    state.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    state.read(reinterpret_cast<char *>(&n_frames), sizeof(n_frames));
+    if (!state || n_frames > (1u << 31))
+      throw std::runtime_error("bad saved trajectory writer");
+    index.resize(n_frames);
+    if (!state.read(reinterpret_cast<char *>(index.data()), n_frames * sizeof(uint64_t)))
+      throw std::runtime_error("bad saved trajectory writer");
+  }
+
+  ~TrajectoryWriter() {
+    flush();
+  }
+
+  // Write all frames so far to out, and what is needed to continue the
+  // trajectory later (frame offsets and bounds) to state
+  void save(std::ostream &state) {
+    flush();
+    uint64_t n_frames = index.size();
+    state.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    state.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    state.write(reinterpret_cast<const char *>(&n_frames), sizeof(n_frames));
+    state.write(reinterpret_cast<const char *>(index.data()), n_frames * sizeof(uint64_t));
+  }
+
+  // Bytes written by this writer so far, including those still buffered
+  uint64_t bytes() const {
+    return written + used;
+  }
+
+  void begin_frame(double time, uint32_t n_points) {
+    index.push_back(offset + used);
+    put(&time, sizeof(time));
+    put(&n_points, sizeof(n_points));
+  }
+
+  void point(double x, double y, unsigned type) {
+    TrajectoryPoint p {static_cast<float>(x), static_cast<float>(y), static_cast<uint16_t>(type), 0};
+    footer.min_x = std::min(footer.min_x, static_cast<double>(p.x));
+    footer.max_x = std::max(footer.max_x, static_cast<double>(p.x));
+    footer.min_y = std::min(footer.min_y, static_cast<double>(p.y));
+    footer.max_y = std::max(footer.max_y, static_cast<double>(p.y));
+    footer.max_type = std::max(footer.max_type, static_cast<uint32_t>(type));
+    put(&p, sizeof(p));
+  }
+
+  // Write the frame index and footer, after which no more frames can be added
+  void finish() {
+    double end_time = 0.0;
+    put(&end_time, sizeof(end_time));
+    put(&trajectory_end, sizeof(trajectory_end));
+    footer.index_offset = offset + used;
+    footer.n_frames = index.size();
+    std::memcpy(footer.magic, trajectory_magic, 4);
+    put(index.data(), index.size() * sizeof(uint64_t));
+    put(&footer, sizeof(footer));
+    flush();
+  }
+
+private:
+  void put(const void *data, size_t n) {
+    if (used + n > buffer.size()) {
+      flush();
+      if (n > buffer.size()) {
+        out.write(static_cast<const char *>(data), n);
+        offset += n;
+        written += n;
+        return;
+      }
+    }
+    std::memcpy(buffer.data() + used, data, n);
+    used += n;
+  }
+
+  void flush() {
+    out.write(buffer.data(), used);
+    offset += used;
+    written += used;
+    used = 0;
+  }
+
+  std::ostream &out;
+  std::vector<char> buffer;
+  size_t used = 0;
+  uint64_t offset = 0;
+  uint64_t written = 0;
+  std::vector<uint64_t> index;
+  TrajectoryFooter footer {0, 0
+                           , std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()
+                           , std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()
+                           , 0, {0, 0, 0, 0}};
+};
+
+
+// Reads a binary trajectory from a stream (e.g. a pipe) one frame at a time,
+// up to the end marker. Only the header and frames are read, so the bounds
+// must be known some other way.
+class TrajectoryReader {
+public:
+  explicit TrajectoryReader(std::istream &in)
+    : in(in) {
+    char magic[4];
+    uint32_t header[3];
+    if (!in.read(magic, 4) || std::memcmp(magic, trajectory_magic, 4) != 0
+        || !in.read(reinterpret_cast<char *>(header), sizeof(header)))
+      throw std::runtime_error("input is not a binary trajectory");
+    if (header[0] < 2 || header[1] != sizeof(TrajectoryPoint))
+      throw std::runtime_error("binary trajectories can only be streamed from version 2");
+  }
+
+  // Read the next frame, false at the end of the frames
+  bool next(double &time, std::vector<TrajectoryPoint> &points) {
+    uint32_t n;
+    if (!in.read(reinterpret_cast<char *>(&time), sizeof(time))
+        || !in.read(reinterpret_cast<char *>(&n), sizeof(n))
+        || n == trajectory_end)
+      return false;
+    points.resize(n);
+    if (!in.read(reinterpret_cast<char *>(points.data()), n * sizeof(TrajectoryPoint)))
+      throw std::runtime_error("truncated frame in binary trajectory");
+    return true;
+  }
+
+  // Skip the next frame, false at the end of the frames
+  bool skip() {
+    double time;
+    uint32_t n;
+    if (!in.read(reinterpret_cast<char *>(&time), sizeof(time))
+        || !in.read(reinterpret_cast<char *>(&n), sizeof(n))
+        || n == trajectory_end)
+      return false;
+    if (!in.ignore(static_cast<std::streamsize>(n) * sizeof(TrajectoryPoint)))
+      throw std::runtime_error("truncated frame in binary trajectory");
+    return true;
+  }
+
+private:
+  std::istream &in;
+};
+
+
+// Read-only memory map of a binary trajectory. Points are used in place.
+class MappedTrajectory {
+public:
+  explicit MappedTrajectory(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("cannot stat " + filename);
+    }
+    length = st.st_size;
+    if (length > 0)
+      data = static_cast<const char *>(mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (data == MAP_FAILED) {
+      data = nullptr;
+      throw std::runtime_error("cannot map " + filename);
+    }
+    if (length < trajectory_header_size || std::memcmp(data, trajectory_magic, 4) != 0) {
+      if (data != nullptr)
+        munmap(const_cast<char *>(data), length);
+      throw std::runtime_error(filename + " is not a binary trajectory");
+    }
+    madvise(const_cast<char *>(data), length, MADV_SEQUENTIAL);
+
+    TrajectoryFooter footer;
+    if (length >= trajectory_header_size + sizeof(footer))
+      std::memcpy(&footer, data + length - sizeof(footer), sizeof(footer));
+    if (length >= trajectory_header_size + sizeof(footer)
+        && std::memcmp(footer.magic, trajectory_magic, 4) == 0
+        && footer.index_offset + footer.n_frames * sizeof(uint64_t) + sizeof(footer) == length) {
+      offsets.resize(footer.n_frames);
+      std::memcpy(offsets.data(), data + footer.index_offset, footer.n_frames * sizeof(uint64_t));
+      min_x = footer.min_x;
+      max_x = footer.max_x;
+      min_y = footer.min_y;
+      max_y = footer.max_y;
+      max_type = footer.max_type;
+    } else {
+      recover();
+    }
+  }
+
+  ~MappedTrajectory() {
+    if (data != nullptr)
+      munmap(const_cast<char *>(data), length);
+  }
+
+  MappedTrajectory(const MappedTrajectory &) = delete;
+  MappedTrajectory &operator=(const MappedTrajectory &) = delete;
+
+  size_t size() const { return offsets.size(); }
+
+  double time(size_t frame) const {
+    double t;
+    std::memcpy(&t, data + offsets[frame], sizeof(t));
+    return t;
+  }
+
+  size_t count(size_t frame) const {
+    uint32_t n;
+    std::memcpy(&n, data + offsets[frame] + sizeof(double), sizeof(n));
+    return n;
+  }
+
+  const TrajectoryPoint *points(size_t frame) const {
+    return reinterpret_cast<const TrajectoryPoint *>(data + offsets[frame] + trajectory_frame_header_size);
+  }
+
+  // Bounds of all points in the trajectory
+  double min_x = std::numeric_limits<double>::max();
+  double max_x = std::numeric_limits<double>::lowest();
+  double min_y = std::numeric_limits<double>::max();
+  double max_y = std::numeric_limits<double>::lowest();
+  size_t max_type = 0;
+
+private:
+  // Rebuild the index and bounds of a file without footer by walking the
+  // frames, ignoring a partially written last frame
+  void recover() {
+    size_t pos = trajectory_header_size;
+    while (pos + trajectory_frame_header_size <= length) {
+      uint32_t n;
+      std::memcpy(&n, data + pos + sizeof(double), sizeof(n));
+      if (n == trajectory_end)
+        break;
+      size_t end = pos + trajectory_frame_header_size + n * sizeof(TrajectoryPoint);
+      if (end > length)
+        break;
+      offsets.push_back(pos);
+      const TrajectoryPoint *p = points(offsets.size() - 1);
+      for (uint32_t i = 0; i < n; ++i) {
+        min_x = std::min(min_x, static_cast<double>(p[i].x));
+        max_x = std::max(max_x, static_cast<double>(p[i].x));
+        min_y = std::min(min_y, static_cast<double>(p[i].y));
+        max_y = std::max(max_y, static_cast<double>(p[i].y));
+        max_type = std::max(max_type, static_cast<size_t>(p[i].type));
+      }
+      pos = end;
+    }
+  }
+
+  const char *data = nullptr;
+  size_t length = 0;
+  std::vector<uint64_t> offsets;
+};
+
+
+
+// Text trajectory format, one frame per line
+//
+//   time T(x, y), T(x, y), ...
+//
+// with the cell type T as a letter, A for type 0. Numbers are written like
+// printf's %.6g. After the last frame there is a summary line of the bounds
+// of all points
+//
+//   # bounds min_x max_x min_y max_y max_type
+//
+// so that a reader can know them before reading all frames. The bounds are
+// rounded like the points, so they are the exact bounds of the points as
+// written. Readers skip empty lines and lines starting with '#'.
+
+// Writes a text trajectory through a large buffer, one frame at a time:
+//   begin_frame(time), then point(x, y, type) for every point, ..., finish()
+class TextTrajectoryWriter {
+public:
+  explicit TextTrajectoryWriter(std::ostream &out)
+    : out(out)
+    , buffer(1 << 20) { }
+
+  // Continue the trajectory of a writer saved with save(), with out
+  // positioned where that writer had got to
+  TextTrajectoryWriter(std::ostream &out, std::istream &state)
+    : out(out)
+    , buffer(1 << 20) {
+    if (!state.read(reinterpret_cast<char *>(&bounds), sizeof(bounds)))
+      throw std::runtime_error("bad saved trajectory writer");
+  }
+
+  ~TextTrajectoryWriter() {
+    if (in_frame)
+      end_frame();
+    flush();
+  }
+
+  // Write all frames so far to out, and what is needed to continue the
+  // trajectory later (the bounds for the summary) to state
+  void save(std::ostream &state) {
+    if (in_frame)
+      end_frame();
+    flush();
+    state.write(reinterpret_cast<const char *>(&bounds), sizeof(bounds));
+  }
+
+  // Bytes written by this writer so far, including those still buffered
+  uint64_t bytes() const {
+    return written + used;
+  }
+
+  void begin_frame(double time) {
+    if (in_frame)
+      end_frame();
+    reserve(32);
+    number(time);
+    buffer[used++] = ' ';
+    first_point = true;
+    in_frame = true;
+  }
+
+  void point(double x, double y, unsigned type) {
+    reserve(64);
+    if (!first_point) {
+      buffer[used++] = ',';
+      buffer[used++] = ' ';
+    }
+    first_point = false;
+    buffer[used++] = static_cast<char>('A' + type);
+    buffer[used++] = '(';
+    number(x);
+    buffer[used++] = ',';
+    buffer[used++] = ' ';
+    number(y);
+    buffer[used++] = ')';
+    // rounding is monotonic, so the bounds rounded like the points are the
+    // bounds of the points as written
+    bounds.add(x, y, type);
+  }
+
+  // Write the summary line, after which no more frames can be added
+  void finish() {
+    if (in_frame)
+      end_frame();
+    reserve(128);
+    const char tag[] = "# bounds ";
+    std::memcpy(buffer.data() + used, tag, sizeof(tag) - 1);
+    used += sizeof(tag) - 1;
+    for (double v: {bounds.min_x, bounds.max_x, bounds.min_y, bounds.max_y}) {
+      number(v);
+      buffer[used++] = ' ';
+    }
+    used = std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), bounds.max_type).ptr - buffer.data();
+    buffer[used++] = '\n';
+    flush();
+  }
+
+private:
+  void end_frame() {
+    reserve(1);
+    buffer[used++] = '\n';
+    in_frame = false;
+  }
+
+  void number(double v) {
+    used = std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), v
+                         , std::chars_format::general, 6).ptr - buffer.data();
+  }
+
+  void reserve(size_t n) {
+    if (used + n > buffer.size())
+      flush();
+  }
+
+  void flush() {
+    out.write(buffer.data(), used);
+    written += used;
+    used = 0;
+  }
+
+  std::ostream &out;
+  std::vector<char> buffer;
+  size_t used = 0;
+  uint64_t written = 0;
+  bool in_frame = false;
+  bool first_point = true;
+  TrajectoryBounds bounds;
+};
+
+
+// Reads a text trajectory through a large buffer, one frame at a time. Numbers
+// are parsed in place with from_chars.
+class TextTrajectoryReader {
+public:
+  explicit TextTrajectoryReader(std::istream &in)
+    : in(in)
+    , buffer(1 << 20) { }
+
+  // Read the next frame, calling point(x, y, type) for each of its points.
+  // False at the end of the input.
+  template <typename F>
+  bool next(double &time, F point) {
+    std::string_view line;
+    if (!next_line(line))
+      return false;
+    const char *p = line.data();
+    const char *end = p + line.size();
+    p = number(p, end, time);
+    while (true) {
+      while (p < end && (*p == ' ' || *p == ',' || *p == '\r'))
+        ++p;
+      if (p == end)
+        break;
+      if (*p < 'A' || *p > 'Z' || p + 1 == end || p[1] != '(')
+        fail("expected a point like A(x, y)");
+      unsigned type = *p - 'A';
+      double x;
+      double y;
+      p = number(p + 2, end, x);
+      if (p == end || *p != ',')
+        fail("expected ','");
+      ++p;
+      while (p < end && *p == ' ')
+        ++p;
+      p = number(p, end, y);
+      if (p == end || *p != ')')
+        fail("expected ')'");
+      ++p;
+      point(x, y, type);
+    }
+    return true;
+  }
+
+  // Skip the next frame without parsing it, false at the end of the input
+  bool skip() {
+    std::string_view line;
+    return next_line(line);
+  }
+
+private:
+  // The next line that isn't empty or a comment, without the newline
+  bool next_line(std::string_view &line) {
+    while (true) {
+      const char *start = buffer.data() + pos;
+      const char *newline = static_cast<const char *>(std::memchr(start, '\n', filled - pos));
+      if (newline == nullptr) {
+        if (eof) {
+          if (pos == filled)
+            return false;
+          newline = buffer.data() + filled;
+        } else {
+          refill();
+          continue;
+        }
+      }
+      line = std::string_view(start, newline - start);
+      pos = std::min(filled, static_cast<size_t>(newline - buffer.data()) + 1);
+      ++line_number;
+      if (!line.empty() && line[0] != '#' && line != "\r")
+        return true;
+    }
+  }
+
+  // Move the partial line at the end of the buffer to the front and read
+  // more after it, growing the buffer if a line doesn't fit
+  void refill() {
+    std::memmove(buffer.data(), buffer.data() + pos, filled - pos);
+    filled -= pos;
+    pos = 0;
+    if (filled == buffer.size())
+      buffer.resize(2 * buffer.size());
+    in.read(buffer.data() + filled, buffer.size() - filled);
+    filled += in.gcount();
+    if (!in)
+      eof = true;
+  }
+
+  const char *number(const char *p, const char *end, double &v) const {
+    auto r = std::from_chars(p, end, v);
+    if (r.ec != std::errc())
+      fail("expected a number");
+    return r.ptr;
+  }
+
+  [[noreturn]] void fail(const std::string &what) const {
+    throw std::runtime_error("trajectory parse error on line " + std::to_string(line_number) + ": " + what);
+  }
+
+  std::istream &in;
+  std::vector<char> buffer;
+  size_t pos = 0;
+  size_t filled = 0;
+  bool eof = false;
+  size_t line_number = 0;
+};
+
+
+// Read the summary line at the end of a text trajectory file, if there is one
+inline bool read_summary(const std::string &filename, TrajectoryBounds &b) {
+  std::ifstream f(filename, std::ios::binary);
+  f.seekg(0, std::ios::end);
+  std::streamoff length = f.tellg();
+  if (!f || length <= 0)
+    return false;
+  std::streamoff tail_length = std::min<std::streamoff>(length, 256);
+  std::string tail(tail_length, '\0');
+  f.seekg(length - tail_length);
+  if (!f.read(&tail[0], tail_length))
+    return false;
+  size_t pos = tail.rfind("# bounds ");
+  if (pos == std::string::npos || (pos > 0 && tail[pos - 1] != '\n'))
+    return false;
+  const char *p = tail.data() + pos + 9;
+  const char *end = tail.data() + tail.size();
+  for (double *v: {&b.min_x, &b.max_x, &b.min_y, &b.max_y}) {
+    auto r = std::from_chars(p, end, *v);
+    if (r.ec != std::errc() || r.ptr == end || *r.ptr != ' ')
+      return false;
+    p = r.ptr + 1;
+  }
+  return std::from_chars(p, end, b.max_type).ec == std::errc();
+}
+
+
+#endif